@@ -0,0 +1,161 @@
+// bigTest - Check operations on an image of more than 2^31 pixels.
+//
+// Creates a 65536x32769 image (2^31 + 65536 pixels, so pixel indices of
+// the last row do not fit in an int), sets a few pixels near its end, and
+// checks that queries, region operations, whole-image operations, layout
+// conversion and a save/load round trip all see them where they should.
+// The pixel array comes from calloc, so untouched pages stay unmapped
+// (sparse) until an operation writes the whole image.
+//
+// Usage: bigTest [DIR]
+// The save/load round trip writes a 2 GB file in DIR (default /tmp).
+// Needs about 3 GB of memory.  Exits with status 1 if any check fails.
+
+#include <errno.h>
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image8bit.h"
+
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    checks++; \
+    if (!(cond)) { failures++; printf("FAILED: %s (line %d)\n", #cond, __LINE__); } \
+  } while (0)
+
+static const int W = 65536;
+static const int H = 32769;
+
+// The pixels set near the end of the image (and their levels)
+static const int marks[][3] = {
+  { 65535, 32768, 200 },   // last pixel
+  { 0, 32768, 100 },       // first pixel of the last row: index 2^31
+  { 12345, 32767, 150 },
+  { 65535, 0, 50 },
+};
+#define NMARKS 4
+
+static void checkMarks(Image img, const char* what) {
+  printf("# %s\n", what);
+  for (int i = 0; i < NMARKS; i++) {
+    CHECK(ImageGetPixel(img, marks[i][0], marks[i][1]) == marks[i][2]);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  const char* dir = argc > 1 ? argv[1] : "/tmp";
+  ImageInit();
+
+  Image img = ImageCreate(W, H, PixMax);
+  if (img == NULL) error(2, errno, "Creating %dx%d image: %s", W, H, ImageErrMsg());
+  printf("# %dx%d image: %zu pixels\n", W, H, (size_t)W * H);
+  for (int i = 0; i < NMARKS; i++) {
+    ImageSetPixel(img, marks[i][0], marks[i][1], (uint8)marks[i][2]);
+  }
+  checkMarks(img, "get/set");
+  CHECK(ImageValidRect(img, W - 10, H - 10, 10, 10));
+  CHECK(!ImageValidRect(img, W - 10, H - 10, 11, 10));
+  CHECK(!ImageValidRect(img, 1, 0, 0x7fffffff, 1));  // x+w would overflow
+
+  printf("# stats, histogram\n");
+  uint8 min, max;
+  ImageStats(img, &min, &max);
+  CHECK(min == 0 && max == 200);
+  uint64_t hist[256];
+  ImageHistogram(img, hist);
+  CHECK(hist[0] == (uint64_t)W * H - NMARKS);
+  CHECK(hist[200] == 1 && hist[100] == 1 && hist[150] == 1 && hist[50] == 1);
+
+  printf("# crop, paste, match\n");
+  Image c = ImageCrop(img, W - 100, H - 100, 100, 100);
+  if (c == NULL) error(2, errno, "Cropping: %s", ImageErrMsg());
+  CHECK(ImageGetPixel(c, 99, 99) == 200);
+  CHECK(ImageMatchSubImage(img, W - 100, H - 100, c));
+  ImageSetPixel(c, 99, 99, 201);
+  CHECK(!ImageMatchSubImage(img, W - 100, H - 100, c));
+  ImagePaste(img, W - 100, H - 100, c);
+  CHECK(ImageGetPixel(img, W - 1, H - 1) == 201);
+  ImageSetPixel(img, W - 1, H - 1, 200);
+  ImageDestroy(&c);
+
+  printf("# region operations\n");
+  ImageNegativeRect(img, 0, H - 1, 10, 1);
+  CHECK(ImageGetPixel(img, 0, H - 1) == PixMax - 100);
+  CHECK(ImageGetPixel(img, 10, H - 1) == 0);
+  ImageNegativeRect(img, 0, H - 1, 10, 1);
+  Image saved = ImageCrop(img, W - 64, H - 64, 64, 64);
+  Image b = ImageCrop(img, W - 64, H - 64, 64, 64);
+  if (saved == NULL || b == NULL) error(2, errno, "Cropping: %s", ImageErrMsg());
+  if (!ImageBlurRect(b, 32, 32, 32, 32, 1, 1)) error(2, errno, "Blurring: %s", ImageErrMsg());
+  if (!ImageBlurRect(img, W - 32, H - 32, 32, 32, 1, 1)) error(2, errno, "Blurring: %s", ImageErrMsg());
+  CHECK(ImageMatchSubImage(img, W - 64, H - 64, b));
+  CHECK(ImageGetPixel(img, W - 1, H - 1) == 200 / 4);  // mean of a 2x2 corner
+  ImagePaste(img, W - 64, H - 64, saved);
+  ImageDestroy(&b);
+  ImageDestroy(&saved);
+  checkMarks(img, "after region operations");
+
+  printf("# orientation views\n");
+  Image r = ImageRotate(img);   // (x,y) of r is (W-1-y, x) of img
+  if (r == NULL) error(2, errno, "Rotating: %s", ImageErrMsg());
+  CHECK(ImageWidth(r) == H && ImageHeight(r) == W);
+  CHECK(ImageGetPixel(r, H - 1, 0) == 200);
+  CHECK(ImageGetPixel(r, 0, 0) == 50);
+  Image rc = ImageCrop(r, H - 2, 0, 2, 2);
+  if (rc == NULL) error(2, errno, "Cropping: %s", ImageErrMsg());
+  CHECK(ImageGetPixel(rc, 1, 0) == 200);
+  ImageDestroy(&rc);
+  ImageDestroy(&r);
+
+  printf("# bitmap, labels\n");
+  Bitmap bm = BitmapFromImage(img, 1);
+  if (bm == NULL) error(2, errno, "Converting: %s", ImageErrMsg());
+  CHECK(BitmapCount(bm) == NMARKS);
+  CHECK(BitmapGetBit(bm, W - 1, H - 1) && BitmapGetBit(bm, 0, H - 1));
+  BitmapDestroy(&bm);
+  ImageComponent* comps;
+  long n = ImageLabelComponents(img, 8, NULL, &comps);
+  CHECK(n == NMARKS);
+  if (n == NMARKS) {
+    CHECK(comps[NMARKS - 1].xmax == W - 1 && comps[NMARKS - 1].ymax == H - 1);
+  }
+  free(comps);
+
+  printf("# save, load\n");
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/bigTest%d.pgm", dir, (int)getpid());
+  if (!ImageSave(img, path)) error(2, errno, "Saving %s: %s", path, ImageErrMsg());
+  Image l = ImageLoad(path);
+  if (l == NULL) error(2, errno, "Loading %s: %s", path, ImageErrMsg());
+  unlink(path);
+  CHECK(ImageWidth(l) == W && ImageHeight(l) == H);
+  checkMarks(l, "loaded");
+  ImageStats(l, &min, &max);
+  CHECK(min == 0 && max == 200);
+  ImageDestroy(&l);
+
+  printf("# whole-image operations\n");
+  ImageNegative(img);
+  ImageStats(img, &min, &max);
+  CHECK(min == PixMax - 200 && max == PixMax);
+  CHECK(ImageGetPixel(img, W - 1, H - 1) == PixMax - 200);
+  ImageNegative(img);
+
+  printf("# tiled layout\n");
+  if (!ImageSetLayout(img, IMAGE_TILED)) error(2, errno, "Tiling: %s", ImageErrMsg());
+  checkMarks(img, "tiled");
+  ImageSetPixel(img, W - 2, H - 1, 7);
+  if (!ImageSetLayout(img, IMAGE_RASTER)) error(2, errno, "Untiling: %s", ImageErrMsg());
+  CHECK(ImageGetPixel(img, W - 2, H - 1) == 7);
+  checkMarks(img, "untiled");
+
+  ImageDestroy(&img);
+  printf(failures == 0 ? "# All %d checks passed\n" : "# %d of %d checks FAILED\n",
+         failures == 0 ? checks : failures, checks);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,88 @@
+// blendTest - Check ImageBlend exhaustively against the exact blend.
+//
+// Blends every pixel pair (p1 up to maxval of img1, p2 any level), for
+// several maxvals and for alphas inside and outside the fixed-point range,
+// with every SIMD level this CPU supports, and compares each result with
+// the double-precision formula, saturated to [0, maxval] of img1 and
+// rounded to the nearest level.
+//
+// Usage: blendTest
+// Exits with status 1 if any result differs.
+
+#include <errno.h>
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "image8bit.h"
+
+// The exact blend of one pixel pair that ImageBlend must give: as blendRef
+// in image8bit.c, in double precision, saturated and rounded to nearest.
+static uint8 blendExact(int p1, int p2, double alpha, int maxval) {
+  double v = (1.0 - alpha) * p1 + alpha * p2;
+  if (v < 0.0) v = 0.0;
+  if (v > maxval) v = maxval;
+  return (uint8)(v + 0.5);
+}
+
+// Check ImageBlend against blendExact for all pixel pairs, with alphas
+// inside and outside the fixed-point range.  Returns the number of wrong
+// results.
+static int checkBlend(void) {
+  const double fixed[] = {
+    0.0, 1.0, 0.5, 0.25, 0.33, 1.0 / 3, 2.0 / 3, 0.1, 0.9, 0.999999,
+    1e-6, -1e-6, -0.7, 1.5, 2.5, -1.0, 3.7, -12.34, 63.99, -63.99, 64.0,
+    -64.0, 64.001, -64.001, 100.0, -300.5, 1e6,
+  };
+  const int nfixed = sizeof(fixed) / sizeof(fixed[0]);
+  const int nrandom = 64;
+  const uint8 maxvals[] = { 255, 200, 100, 1 };
+  int wrong = 0;
+  Image top = ImageCreate(256, 1, PixMax);  // img2: every level in a row
+  if (top == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  for (int p2 = 0; p2 < 256; p2++) ImageSetPixel(top, p2, 0, (uint8)p2);
+  uint32_t seed = 2024u;
+  for (int m = 0; m < 4; m++) {
+    int maxval = maxvals[m];
+    for (int a = 0; a < nfixed + nrandom; a++) {
+      double alpha;
+      if (a < nfixed) {
+        alpha = fixed[a];
+      } else {  // mostly around [0, 1], some anywhere in the fixed-point range
+        seed = seed * 1103515245u + 12345u;
+        double u = (seed >> 8) / 16777216.0;
+        alpha = a % 4 == 0 ? 130.0 * u - 65.0 : 3.0 * u - 1.0;
+      }
+      for (int p1 = 0; p1 <= maxval; p1++) {
+        Image img = ImageCreate(256, 1, (uint8)maxval);
+        if (img == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+        for (int p2 = 0; p2 < 256; p2++) ImageSetPixel(img, p2, 0, (uint8)p1);
+        ImageBlend(img, 0, 0, top, alpha);
+        for (int p2 = 0; p2 < 256; p2++) {
+          wrong += ImageGetPixel(img, p2, 0) != blendExact(p1, p2, alpha, maxval);
+        }
+        ImageDestroy(&img);
+      }
+    }
+  }
+  ImageDestroy(&top);
+  return wrong;
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  ImageInit();
+  ImageSIMDLevel initial = ImageGetSIMD();
+  int failures = 0;
+  for (int level = IMAGE_SIMD_SCALAR; level <= (int)ImageBestSIMD(); level++) {
+    ImageSetSIMD(level);
+    int wrong = checkBlend();
+    if (wrong != 0) {
+      failures++;
+      printf("MISMATCH: %s, blend: %d wrong pixels\n", ImageSIMDName(level), wrong);
+    }
+  }
+  printf(failures == 0 ? "# Blend exact for all pixel pairs at every level\n"
+                       : "# %d levels wrong\n", failures);
+  ImageSetSIMD(initial);
+  return failures == 0 ? 0 : 1;
+}
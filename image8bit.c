@@ -23,7 +23,13 @@
 #include <ctype.h>
 #include <errno.h>
 #include <stdio.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "instrumentation.h"
 
 // The data structure
@@ -38,6 +44,10 @@
 //   pixel position (x,y) = (33,0) is stored in img->pixel[33];
 //   pixel position (x,y) = (22,1) is stored in img->pixel[122].
 // 
+// Images may instead use a tiled layout (IMAGE_TILED), where the image is
+// cut into TILExTILE tiles, each stored contiguously in raster order, and
+// tiles follow each other in raster order (see pixIndex below).
+// 
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
 // structure fields directly.
@@ -50,7 +60,14 @@ struct image {
   int width;
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
-  uint8* pixel; // pixel data (a raster scan)
+  uint8* pixel; // pixel data (a raster scan, or tiles: see layout)
+  ImageLayout layout;
+  uint8* band;  // if tiled: scratch rows for layout conversions (see below)
+  // Lazy orientation (see below):
+  int orient;   // tag mapping this image's coords to src's
+  Image src;    // if not NULL, pixels are src's, read through orient
+  Image views;  // list of the images that have this one as src
+  Image next;   // next image in src's list of views
 };
 
 
@@ -74,10 +91,10 @@ struct image {
 // Additional information:  man 3 errno;  man 3 error;
 
 // Variable to preserve errno temporarily
-static int errsave = 0;
+static _Thread_local int errsave = 0;
 
-// Error cause
-static char* errCause;
+// Error cause (per thread, like errno)
+static _Thread_local char* errCause;
 
 /// Error cause.
 /// After some other module function fails (and returns an error code),
@@ -87,6 +104,7 @@ static char* errCause;
 ///
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
+/// Like errno, the error cause is kept per thread.
 char* ImageErrMsg() { ///
   return errCause;
 }
@@ -141,13 +159,193 @@ static int check(int condition, const char* failmsg) {
 }
 
 
+// Upper limit for the number of threads (see ImageSetThreads)
+#define MAXTHREADS 256
+
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Calibrate instrumentation, set names of counters, set the number of
+/// worker threads to the number of online CPUs (or to $IMAGE_THREADS), and
+/// select the best SIMD kernels for this CPU (or the level named in
+/// $IMAGE_SIMD, if it is supported).
 void ImageInit(void) { ///
   InstrCalibrate();
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
   // Name other counters here...
   
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  const char* env = getenv("IMAGE_THREADS");
+  if (env != NULL) n = atol(env);
+  ImageSetThreads(n < 1 ? 1 : (n > MAXTHREADS ? MAXTHREADS : (int)n));
+
+  // Best kernels for this CPU, or a lower level named in $IMAGE_SIMD
+  ImageSIMDLevel level = ImageBestSIMD();
+  const char* simd = getenv("IMAGE_SIMD");
+  for (int l = IMAGE_SIMD_SCALAR; simd != NULL && l <= (int)level; l++) {
+    if (strcmp(simd, ImageSIMDName(l)) == 0) level = l;
+  }
+  ImageSetSIMD(level);
+}
+
+
+// Parallel execution
+//
+// A few operations split their work into independent tasks and run them
+// on up to nThreads threads.  Instrumentation counters are not thread-safe,
+// so tasks never touch them: callers count in the calling thread.
+
+// Maximum number of threads used by parallel operations
+static int nThreads = 1;
+
+/// Set the maximum number of threads used by operations that run in
+/// parallel (their documentation says so).
+/// Requires: n >= 1.
+void ImageSetThreads(int n) { ///
+  assert (n >= 1);
+  nThreads = n > MAXTHREADS ? MAXTHREADS : n;
+}
+
+/// Get the maximum number of threads used by parallel operations.
+int ImageThreads(void) { ///
+  return nThreads;
+}
+
+// A parallel loop: tasks 0..n-1 are handed out to workers in order.
+typedef struct {
+  void (*task)(void* ctx, int i);
+  void* ctx;
+  int n;
+  atomic_int next;
+} ParallelFor;
+
+static void* parallelWorker(void* arg) {
+  ParallelFor* pf = arg;
+  int i;
+  while ((i = atomic_fetch_add(&pf->next, 1)) < pf->n) {
+    pf->task(pf->ctx, i);
+  }
+  return NULL;
+}
+
+// Run task(ctx, i) for i in [0, n), on up to nThreads threads (including
+// the calling one), and wait for all of them.  If threads cannot be
+// created, the calling thread does the remaining work.
+static void parallelFor(int n, void (*task)(void* ctx, int i), void* ctx) {
+  ParallelFor pf = { task, ctx, n, 0 };
+  int nt = n < nThreads ? n : nThreads;
+  pthread_t tid[MAXTHREADS];
+  int started = 0;
+  for (int t = 1; t < nt; t++) {
+    if (pthread_create(&tid[started], NULL, parallelWorker, &pf) != 0) break;
+    started++;
+  }
+  parallelWorker(&pf);
+  for (int t = 0; t < started; t++) {
+    pthread_join(tid[t], NULL);
+  }
+}
+
+// CPU dispatch
+//
+// Hot pixel kernels (see image8bitKernels.inc) are compiled once per SIMD
+// level, and called through the table K of the level in use, chosen by
+// ImageInit from what the CPU supports (cpuid), or by ImageSetSIMD.
+// Levels other than scalar exist only for x86 builds with GCC or clang.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KERNELS_X86 1
+#else
+#define KERNELS_X86 0
+#endif
+
+// A dispatch table: one implementation of each kernel.
+typedef struct {
+  void (*negate)(uint8* p, size_t n, uint8 maxval);
+  void (*threshold)(uint8* p, size_t n, uint8 thr, uint8 maxval);
+  void (*brighten)(uint8* p, size_t n, double factor, uint8 maxval);
+  void (*minMax)(const uint8* p, size_t n, uint8* lo, uint8* hi);
+  void (*blendRow)(uint8* r1, const uint8* r2, int n, int32_t A, int32_t band,
+                   double alpha, int maxval);
+  void (*blendMaskRow)(uint8* r1, const uint8* r2, const uint8* rm, int n,
+                       int32_t Am, int maxval);
+  void (*accRow)(uint32_t* acc, const uint8* p, int n, int sign);
+  void (*reverseRow)(uint8* d, const uint8* s, int n);
+  void (*gatherRow)(uint8* d, const uint8* s, ptrdiff_t step, int n);
+  void (*minRow)(uint8* run, const uint8* s, uint8 flip, int n);
+  void (*minPair)(uint8* d, const uint8* a, const uint8* b, uint8 flip, int n);
+  void (*narrow16)(uint8* d, const uint16* s, size_t n, uint32_t smax, uint32_t dmax,
+                   uint64_t R);
+  void (*widen16)(uint16* d, const uint8* s, size_t n, uint32_t smax, uint32_t dmax,
+                  uint64_t R);
+  void (*resizeCol)(uint16* t, uint32_t* acc, const uint8* const* rows, const int32_t* wt,
+                    int taps, int n);
+  void (*resizeRow)(uint8* d, uint32_t* acc, const uint16* t, const int32_t* start,
+                    const int32_t* wt, int taps, int n);
+  size_t (*firstDiff)(const uint8* a, const uint8* b, size_t n);
+  void (*absDiff)(uint8* d, const uint8* a, const uint8* b, size_t n);
+  void (*diffStats)(const uint8* a, const uint8* b, size_t n, uint64_t* sse, uint8* maxabs);
+} Kernels;
+
+// Kernel names: KCAT(f, avx2) is f_avx2.
+#define KCAT_(f, level) f##_##level
+#define KCAT(f, level) KCAT_(f, level)
+
+// The tables of each level (defined where the kernels are compiled)
+static const Kernels kernels_scalar;
+#if KERNELS_X86
+static const Kernels kernels_sse4;
+static const Kernels kernels_avx2;
+static const Kernels kernels_avx512;
+#endif
+
+// Kernels in use, and their level
+static const Kernels* K = &kernels_scalar;
+static ImageSIMDLevel simdLevel = IMAGE_SIMD_SCALAR;
+
+/// Name of a SIMD level: "scalar", "sse4", "avx2" or "avx512".
+const char* ImageSIMDName(ImageSIMDLevel level) { ///
+  static const char* names[] = { "scalar", "sse4", "avx2", "avx512" };
+  assert (IMAGE_SIMD_SCALAR <= level && level <= IMAGE_SIMD_AVX512);
+  return names[level];
+}
+
+/// The highest SIMD level supported by this CPU (and build).
+ImageSIMDLevel ImageBestSIMD(void) { ///
+#if KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+    return IMAGE_SIMD_AVX512;
+  }
+  if (__builtin_cpu_supports("avx2")) return IMAGE_SIMD_AVX2;
+  if (__builtin_cpu_supports("sse4.1")) return IMAGE_SIMD_SSE4;
+#endif
+  return IMAGE_SIMD_SCALAR;
+}
+
+/// Use the kernels of the given SIMD level from now on.
+/// All levels produce exactly the same results; only speed differs.
+/// On success, returns nonzero.
+/// On failure (level not supported by this CPU), returns 0, sets errCause,
+/// and keeps the current level.
+int ImageSetSIMD(ImageSIMDLevel level) { ///
+  assert (IMAGE_SIMD_SCALAR <= level && level <= IMAGE_SIMD_AVX512);
+  if (!check( level <= ImageBestSIMD(), "SIMD level not supported" )) {
+    return 0;
+  }
+  simdLevel = level;
+  switch (level) {
+#if KERNELS_X86
+  case IMAGE_SIMD_AVX512: K = &kernels_avx512; break;
+  case IMAGE_SIMD_AVX2: K = &kernels_avx2; break;
+  case IMAGE_SIMD_SSE4: K = &kernels_sse4; break;
+#endif
+  default: K = &kernels_scalar; break;
+  }
+  return 1;
+}
+
+/// The SIMD level in use.
+ImageSIMDLevel ImageGetSIMD(void) { ///
+  return simdLevel;
 }
 
 // Macros to simplify accessing instrumentation counters:
@@ -157,30 +355,334 @@ void ImageInit(void) { ///
 // TIP: Search for PIXMEM or InstrCount to see where it is incremented!
 
 
+// Tiled layout
+//
+// Tiles are TILExTILE, except in the last tile column and row, where they
+// are narrower or shorter: the pixel array is a permutation of the raster,
+// of the same size.  So operations where pixel order does not matter
+// (levels, stats) run unchanged on both layouts.
+// The rows y0..y0+TILE-1 (y0 multiple of TILE) occupy the same part of the
+// pixel array in both layouts, so one such band is converted at a time,
+// through the image's scratch band, which is allocated together with a
+// tiled image so that conversions never fail.  Operations that need
+// raster order internally (filters, blending, matching, ...) untile the
+// image in place, and retile it when done.
+
+// Tile side (a power of 2)
+#define TILE 64
+
+// Index in img->pixel of position (x,y), for either layout.
+static inline size_t pixIndex(Image img, int x, int y) {
+  if (img->layout == IMAGE_RASTER) return (size_t)y * img->width + x;
+  int x0 = x & ~(TILE - 1);
+  int y0 = y & ~(TILE - 1);
+  int tw = img->width - x0 < TILE ? img->width - x0 : TILE;
+  int th = img->height - y0 < TILE ? img->height - y0 : TILE;
+  return (size_t)y0 * img->width + (size_t)x0 * th + (size_t)(y - y0) * tw + (x - x0);
+}
+
+// Pointer to position (x,y), and (in *n) the number of pixels of row y
+// stored contiguously from there.
+static inline uint8* rowSpan(Image img, int x, int y, int* n) {
+  if (img->layout == IMAGE_RASTER) {
+    *n = img->width - x;
+  } else {
+    int x0 = x & ~(TILE - 1);
+    *n = (img->width - x0 < TILE ? img->width - x0 : TILE) - (x - x0);
+  }
+  return img->pixel + pixIndex(img, x, y);
+}
+
+// Convert a band of th rows of width w from raster (src) to tiles (dst).
+static void tileBand(uint8* dst, const uint8* src, int w, int th) {
+  for (int x0 = 0; x0 < w; x0 += TILE) {
+    int tw = w - x0 < TILE ? w - x0 : TILE;
+    uint8* d = dst + (size_t)x0 * th;
+    for (int r = 0; r < th; r++) {
+      memcpy(d + (size_t)r * tw, src + (size_t)r * w + x0, tw);
+    }
+  }
+}
+
+// Convert a band of th rows of width w from tiles (src) to raster (dst).
+static void untileBand(uint8* dst, const uint8* src, int w, int th) {
+  for (int x0 = 0; x0 < w; x0 += TILE) {
+    int tw = w - x0 < TILE ? w - x0 : TILE;
+    const uint8* s = src + (size_t)x0 * th;
+    for (int r = 0; r < th; r++) {
+      memcpy(dst + (size_t)r * w + x0, s + (size_t)r * tw, tw);
+    }
+  }
+}
+
+// Convert the pixels of img in place, band by band, to layout (img must
+// have a scratch band).
+static void convertLayout(Image img, ImageLayout layout) {
+  if (img->layout == layout) return;
+  int w = img->width;
+  for (int y0 = 0; y0 < img->height; y0 += TILE) {
+    int th = img->height - y0 < TILE ? img->height - y0 : TILE;
+    uint8* p = img->pixel + (size_t)y0 * w;
+    memcpy(img->band, p, (size_t)th * w);
+    if (layout == IMAGE_TILED) {
+      tileBand(p, img->band, w, th);
+    } else {
+      untileBand(p, img->band, w, th);
+    }
+  }
+  img->layout = layout;
+  PIXMEM += 2ul * w * img->height;  // read and write each pixel
+}
+
+// Put img in raster layout, for an operation that needs it, returning the
+// previous layout, to be restored with retile when done.  Never fails.
+static ImageLayout untile(Image img) {
+  ImageLayout was = img->layout;
+  convertLayout(img, IMAGE_RASTER);
+  return was;
+}
+
+// Restore the layout saved by untile.
+static void retile(Image img, ImageLayout was) {
+  convertLayout(img, was);
+}
+
+// Allocate the scratch band of a tiled image of width w, height h.
+static uint8* newBand(int w, int h) {
+  size_t rows = h < TILE ? (size_t)h : TILE;
+  return (uint8*)malloc(rows * w > 0 ? rows * w : 1);
+}
+
+// Lazy orientation
+//
+// Rotations and flips (the 8 symmetries of a rectangle) are not applied
+// when requested.  ImageRotate and friends return a *view*: an image whose
+// src points to an image holding the pixels, and whose orient tag maps the
+// view's coordinates to src's.  A view of a view takes the same src and
+// the composition of both tags, so chained orientations cost O(1) each.
+//
+// A view owns a pixel array, allocated (but not filled) when it is created,
+// so that filling it later cannot fail.  Its pixels are copied once, in a
+// single cache-blocked pass, when they are first needed in raster order
+// (materialize), or before src is modified or destroyed (unshare).
+// Some consumers (ImageGetPixel, ImageCrop, ImagePaste, ImageStats and
+// ImageHistogram) read through the tag and never materialize.
+
+// Orientation tag bits.  Position (x,y) of a view maps to (u,v) = (y,x)
+// if ORIENT_T, or (x,y) otherwise, which is then flipped to
+// (srcW-1-u, v) if ORIENT_FX and to (u, srcH-1-v) if ORIENT_FY.
+#define ORIENT_FX 1
+#define ORIENT_FY 2
+#define ORIENT_T 4
+
+// Side of the square blocks in which transposing views are copied.
+#define ORIENT_BLOCK 64
+
+// Tag of the view s of a view with tag t (t and the result relative to
+// the same src).
+static int orientCompose(int t, int s) {
+  int fx = s & ORIENT_FX;
+  int fy = (s & ORIENT_FY) >> 1;
+  if (t & ORIENT_T) {  // s's flips act on the other axis of src
+    int tmp = fx; fx = fy; fy = tmp;
+  }
+  return t ^ (s & ORIENT_T) ^ fx ^ (fy << 1);
+}
+
+// Index in src->pixel of position (x,y) of the view (src, t).
+static inline size_t orientIndex(Image src, int t, int x, int y) {
+  if (t & ORIENT_T) {
+    int tmp = x; x = y; y = tmp;
+  }
+  if (t & ORIENT_FX) x = src->width - 1 - x;
+  if (t & ORIENT_FY) y = src->height - 1 - y;
+  return pixIndex(src, x, y);
+}
+
+// The image holding img's pixels, and (in *t) the tag to read them with.
+static inline Image viewSrc(Image img, int* t) {
+  *t = img->src != NULL ? img->orient : 0;
+  return img->src != NULL ? img->src : img;
+}
+
+// Copy the rectangle (x,y,w,h) of the view (src, t) into dst at (dx,dy).
+// Rows of views without ORIENT_T are rows of src, copied by contiguous
+// spans (whole rows in raster layout), reversed if ORIENT_FX.
+// With ORIENT_T, they are columns of src: copying in square blocks keeps
+// the ORIENT_BLOCK src rows being walked in cache until the block is done.
+static void orientCopy(Image dst, int dx, int dy, Image src, int t, int x, int y, int w, int h) {
+  if (w <= 0 || h <= 0) return;
+  int raster = dst->layout == IMAGE_RASTER && src->layout == IMAGE_RASTER;
+  if (!(t & (ORIENT_T | ORIENT_FX))) {
+    for (int i = 0; i < h; i++) {
+      int sy = (t & ORIENT_FY) ? src->height - 1 - (y + i) : y + i;
+      for (int j = 0; j < w; ) {
+        int n1, n2;
+        uint8* d = rowSpan(dst, dx + j, dy + i, &n1);
+        const uint8* s = rowSpan(src, x + j, sy, &n2);
+        int n = n1 < n2 ? n1 : n2;
+        n = n < w - j ? n : w - j;
+        memcpy(d, s, n);
+        j += n;
+      }
+    }
+  } else if (raster && !(t & ORIENT_T)) {
+    for (int i = 0; i < h; i++) {
+      const uint8* row = src->pixel + orientIndex(src, t, x, y + i);
+      uint8* d = dst->pixel + (size_t)(dy + i) * dst->width + dx;
+      K->reverseRow(d, row, w);
+    }
+  } else if (raster) {
+    ptrdiff_t step = (t & ORIENT_FY) ? -(ptrdiff_t)src->width : (ptrdiff_t)src->width;
+    for (int i0 = 0; i0 < h; i0 += ORIENT_BLOCK) {
+      int i1 = i0 + ORIENT_BLOCK < h ? i0 + ORIENT_BLOCK : h;
+      for (int j0 = 0; j0 < w; j0 += ORIENT_BLOCK) {
+        int n = j0 + ORIENT_BLOCK < w ? ORIENT_BLOCK : w - j0;
+        for (int i = i0; i < i1; i++) {
+          const uint8* col = src->pixel + orientIndex(src, t, x + j0, y + i);
+          uint8* d = dst->pixel + (size_t)(dy + i) * dst->width + dx + j0;
+          K->gatherRow(d, col, step, n);
+        }
+      }
+    }
+  } else {
+    // Some side is tiled: index every pixel, still by blocks
+    for (int i0 = 0; i0 < h; i0 += ORIENT_BLOCK) {
+      int i1 = i0 + ORIENT_BLOCK < h ? i0 + ORIENT_BLOCK : h;
+      for (int j0 = 0; j0 < w; j0 += ORIENT_BLOCK) {
+        int j1 = j0 + ORIENT_BLOCK < w ? j0 + ORIENT_BLOCK : w;
+        for (int i = i0; i < i1; i++) {
+          for (int j = j0; j < j1; j++) {
+            dst->pixel[pixIndex(dst, dx + j, dy + i)] =
+              src->pixel[orientIndex(src, t, x + j, y + i)];
+          }
+        }
+      }
+    }
+  }
+  PIXMEM += 2 * (unsigned long)w * h;  // read and write each pixel
+}
+
+// Remove view img from its src's list of views.
+static void unlinkView(Image img) {
+  Image* p = &img->src->views;
+  while (*p != img) p = &(*p)->next;
+  *p = img->next;
+  img->src = NULL;
+  img->next = NULL;
+  img->orient = 0;
+}
+
+// Give img its own pixels in raster order (no-op if it is not a view).
+static void materialize(Image img) {
+  if (img->src == NULL) return;
+  orientCopy(img, 0, 0, img->src, img->orient, 0, 0, img->width, img->height);
+  unlinkView(img);
+}
+
+// Prepare img to be modified: materialize it and all views of it.
+static void unshare(Image img) {
+  materialize(img);
+  while (img->views != NULL) materialize(img->views);
+}
+
+// Create a view of img, transformed by tag t.
+// Success and failure are treated as in ImageCreate.
+static Image orientView(Image img, int t) {
+  int w = (t & ORIENT_T) ? img->height : img->width;
+  int h = (t & ORIENT_T) ? img->width : img->height;
+  Image v = (Image)malloc(sizeof(struct image));
+  if (!check( v != NULL, "Allocating image failed" )) {
+    return NULL;
+  }
+  // Reserved, not filled: large blocks are mapped lazily by the system,
+  // so no pixel is touched unless the view is materialized.
+  v->pixel = (uint8*)malloc((size_t)w * h > 0 ? (size_t)w * h : 1);
+  if (!check( v->pixel != NULL, "Allocating pixels failed" )) {
+    errsave = errno;
+    free(v);
+    errno = errsave;
+    return NULL;
+  }
+  v->layout = img->layout;
+  v->band = NULL;
+  if (img->layout == IMAGE_TILED &&
+      !check( (v->band = newBand(w, h)) != NULL, "Allocating pixels failed" )) {
+    errsave = errno;
+    free(v->pixel);
+    free(v);
+    errno = errsave;
+    return NULL;
+  }
+  int t0;
+  Image src = viewSrc(img, &t0);
+  v->width = w;
+  v->height = h;
+  v->maxval = img->maxval;
+  v->orient = orientCompose(t0, t);
+  v->src = src;
+  v->views = NULL;
+  v->next = src->views;
+  src->views = v;
+  return v;
+}
+
+
 /// Image management functions
 
 /// Create a new black image.
 ///   width, height : the dimensions of the new image.
 ///   maxval: the maximum gray level (corresponding to white).
 /// Requires: width and height must be non-negative, maxval > 0.
+/// Pixel counts and indices are size_t, so width*height may exceed 2^31
+/// (each dimension is an int).  The pixel array is allocated lazily by
+/// calloc, so a huge image only takes memory for the pages written.
 ///   
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCreate(int width, int height, uint8 maxval) { ///
+  return ImageCreateLayout(width, height, maxval, IMAGE_RASTER);
+}
+
+/// Create a new black image with the given pixel layout.
+/// Otherwise, as ImageCreate.
+Image ImageCreateLayout(int width, int height, uint8 maxval, ImageLayout layout) { ///
   assert (width >= 0);
   assert (height >= 0);
   assert (0 < maxval && maxval <= PixMax);
+  assert (layout == IMAGE_RASTER || layout == IMAGE_TILED);
+  // The pixel count must fit in a size_t (always true on 64-bit systems)
+  if (!check( height == 0 || (size_t)width <= SIZE_MAX / (size_t)height, "Image too large" )) {
+    errno = EOVERFLOW;
+    return NULL;
+  }
   // Allocating memory for both the Image structure and the pixel array inside said structure
-  Image img = (Image)malloc(sizeof(Image*));
-  img->pixel = (uint8*)malloc(sizeof(uint8) * width * height);
-  if (img == NULL) {
-      fprintf(stderr, "Error: Memory allocation failed.\n");
-      return NULL;
+  Image img = (Image)malloc(sizeof(struct image));
+  if (!check( img != NULL, "Allocating image failed" )) {
+    return NULL;
+  }
+  // calloc gives us the black image the contract promises
+  img->pixel = (uint8*)calloc((size_t)width * height, sizeof(uint8));
+  img->band = NULL;
+  int success =
+  check( img->pixel != NULL, "Allocating pixels failed" ) &&
+  check( layout == IMAGE_RASTER || (img->band = newBand(width, height)) != NULL, "Allocating pixels failed" );
+  if (!success) {
+    errsave = errno;
+    free(img->pixel);
+    free(img);
+    errno = errsave;
+    return NULL;
   }
   img->width = width;
   img->height = height;
   img->maxval = maxval;
+  img->layout = layout;
+  img->orient = 0;
+  img->src = NULL;
+  img->views = NULL;
+  img->next = NULL;
 
   return img;
 
@@ -193,12 +695,49 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) { ///
   assert (imgp != NULL);
+  if (*imgp == NULL) return;
+  if ((*imgp)->src != NULL) {
+    unlinkView(*imgp);
+  } else {
+    unshare(*imgp);  // views of it get their own pixels (cannot fail)
+  }
+  free((*imgp)->band);
   free((*imgp)->pixel);
   free(*imgp);
   *imgp = NULL;
 }
 
 
+/// Get the pixel layout of img.
+ImageLayout ImageGetLayout(Image img) { ///
+  assert (img != NULL);
+  return img->layout;
+}
+
+/// Convert img to the given pixel layout, in place.
+/// Converting to IMAGE_TILED allocates a scratch band of 64 rows.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageSetLayout(Image img, ImageLayout layout) { ///
+  assert (img != NULL);
+  assert (layout == IMAGE_RASTER || layout == IMAGE_TILED);
+  materialize(img);
+  if (img->layout == layout) return 1;
+  if (layout == IMAGE_TILED) {
+    if (!check( (img->band = newBand(img->width, img->height)) != NULL, "Allocating pixels failed" )) {
+      return 0;
+    }
+    convertLayout(img, IMAGE_TILED);
+  } else {
+    convertLayout(img, IMAGE_RASTER);
+    free(img->band);
+    img->band = NULL;
+  }
+  return 1;
+}
+
+
 /// PGM file operations
 
 // See also:
@@ -216,34 +755,221 @@ static int skipComments(FILE* f) {
   return i;
 }
 
-/// Load a raw PGM file.
-/// Only 8 bit PGM files are accepted.
+// Maximum maxval of PGM files (16-bit samples)
+#define MAXVAL16 65535
+
+// Rescaling levels from [0, smax] to [0, dmax], rounded to the nearest level:
+// (v*dmax + smax/2) / smax is computed as a multiply by R = ceil(2^40/smax)
+// and a shift, which vectorizes (integer division does not).  With
+// N = v*dmax + smax/2, the result is exact while N*smax <= 2^40, which holds
+// whenever one of smax and dmax is at most 255 and the other at most 65535.
+#define RESCALE_SHIFT 40
+
+static uint64_t rescaleRecip(uint32_t smax) {
+  return ((UINT64_C(1) << RESCALE_SHIFT) + smax - 1) / smax;
+}
+
+/// Convert n 16-bit samples with levels in [0, srcMaxval] to pixel levels
+/// in [0, maxval], rounded to the nearest level (samples above srcMaxval
+/// count as srcMaxval).  Runs with the SIMD level in use (see ImageSetSIMD).
+void ImageNarrow16(uint8* dst, const uint16* src, size_t n, int srcMaxval, uint8 maxval) { ///
+  assert (dst != NULL && src != NULL);
+  assert (0 < srcMaxval && srcMaxval <= MAXVAL16);
+  assert (0 < maxval);
+  K->narrow16(dst, src, n, srcMaxval, maxval, rescaleRecip(srcMaxval));
+}
+
+// Read n plain (ASCII decimal) samples, each at most maxval, from f into row.
+// A small tokenizer instead of fscanf: digits are accumulated straight
+// from getc_unlocked (the caller holds the lock of f).
+// Each sample must be followed by whitespace (consumed) or the end of file.
+static int readPlainRow(FILE* f, uint16* row, size_t n, int maxval) {
+  for (size_t j = 0; j < n; j++) {
+    int c;
+    while ((c = getc_unlocked(f)) != EOF && isspace(c)) {}
+    if (c < '0' || c > '9') return 0;
+    int v = 0;
+    do {
+      v = 10 * v + (c - '0');
+      if (v > maxval) return 0;
+    } while ((c = getc_unlocked(f)) >= '0' && c <= '9');
+    if (c != EOF && !isspace(c)) return 0;
+    row[j] = (uint16)v;
+  }
+  return 1;
+}
+
+// Read n raw 16-bit samples (big-endian, as in PGM files) from f into row,
+// using raw (2n bytes) as the read buffer.
+static int readWideRow(FILE* f, uint16* row, uint8* raw, size_t n) {
+  if (fread(raw, 2, n, f) != n) return 0;
+  for (size_t j = 0; j < n; j++) {
+    row[j] = (uint16)(raw[2 * j] << 8 | raw[2 * j + 1]);
+  }
+  return 1;
+}
+
+// Read the pixels of img from f, in raster order, as samples of a file with
+// the given maxval, in plain (ASCII) or raw format.
+// Raw 8-bit samples are read directly; other samples are read a row at a
+// time and rescaled to [0, maxval of img] (see ImageNarrow16).
+// Tiled images are read one band at a time into the scratch band.
+// Returns nonzero on success.
+static int readPixels(Image img, FILE* f, int plain, int maxval) {
+  size_t w = img->width;
+  if (plain || maxval > PixMax) {
+    uint16* row = malloc(w * (sizeof(uint16) + 2));
+    if (row == NULL) return 0;
+    uint8* raw = (uint8*)(row + w);
+    uint64_t R = rescaleRecip(maxval);
+    int ok = 1;
+    if (plain) flockfile(f);
+    for (int y0 = 0; ok && y0 < img->height; y0 += TILE) {
+      int th = img->height - y0 < TILE ? img->height - y0 : TILE;
+      uint8* dst = img->layout == IMAGE_RASTER ? img->pixel + y0 * w : img->band;
+      for (int y = 0; ok && y < th; y++) {
+        ok = plain ? readPlainRow(f, row, w, maxval) : readWideRow(f, row, raw, w);
+        if (ok) K->narrow16(dst + y * w, row, w, maxval, img->maxval, R);
+      }
+      if (ok && img->layout == IMAGE_TILED) tileBand(img->pixel + y0 * w, img->band, w, th);
+    }
+    if (plain) funlockfile(f);
+    free(row);
+    return ok;
+  }
+  if (img->layout == IMAGE_RASTER) {
+    return fread(img->pixel, sizeof(uint8), w * img->height, f) == w * img->height;
+  }
+  for (int y0 = 0; y0 < img->height; y0 += TILE) {
+    int th = img->height - y0 < TILE ? img->height - y0 : TILE;
+    if (fread(img->band, sizeof(uint8), th * w, f) != th * w) return 0;
+    tileBand(img->pixel + y0 * w, img->band, w, th);
+  }
+  return 1;
+}
+
+// Write the pixels of img to f, in raster order.  As readPixels.
+static int writePixels(Image img, FILE* f) {
+  size_t w = img->width;
+  if (img->layout == IMAGE_RASTER) {
+    return fwrite(img->pixel, sizeof(uint8), w * img->height, f) == w * img->height;
+  }
+  for (int y0 = 0; y0 < img->height; y0 += TILE) {
+    int th = img->height - y0 < TILE ? img->height - y0 : TILE;
+    untileBand(img->band, img->pixel + y0 * w, w, th);
+    if (fwrite(img->band, sizeof(uint8), th * w, f) != th * w) return 0;
+  }
+  return 1;
+}
+
+// Write the pixels of img to f, in raster order, as raw 16-bit samples
+// (big-endian) rescaled to [0, maxval] (see widen16).  As writePixels.
+static int writePixels16(Image img, FILE* f, int maxval) {
+  size_t w = img->width;
+  uint16* row = malloc(w * (sizeof(uint16) + 2));
+  if (row == NULL) return 0;
+  uint8* raw = (uint8*)(row + w);
+  uint64_t R = rescaleRecip(img->maxval);
+  int ok = 1;
+  for (int y0 = 0; ok && y0 < img->height; y0 += TILE) {
+    int th = img->height - y0 < TILE ? img->height - y0 : TILE;
+    const uint8* src = img->pixel + y0 * w;
+    if (img->layout == IMAGE_TILED) {
+      untileBand(img->band, img->pixel + y0 * w, w, th);
+      src = img->band;
+    }
+    for (int y = 0; ok && y < th; y++) {
+      K->widen16(row, src + y * w, w, img->maxval, maxval, R);
+      for (size_t j = 0; j < w; j++) {
+        raw[2 * j] = (uint8)(row[j] >> 8);
+        raw[2 * j + 1] = (uint8)row[j];
+      }
+      ok = fwrite(raw, 2, w, f) == w;
+    }
+  }
+  free(row);
+  return ok;
+}
+
+/// Load a PGM file.
+/// Raw (P5) and plain (P2) files are accepted, with maxval up to 65535.
+/// Levels of files with maxval above PixMax (16-bit samples) are rescaled
+/// to [0, PixMax], rounded to the nearest level.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) { ///
-  int w, h;
-  int maxval;
-  char c;
+  return ImageLoadLayout(filename, IMAGE_RASTER);
+}
+
+/// Load a PGM file into an image with the given pixel layout.
+/// Otherwise, as ImageLoad.
+Image ImageLoadLayout(const char* filename, ImageLayout layout) { ///
   FILE* f = NULL;
   Image img = NULL;
 
   int success = 
   check( (f = fopen(filename, "rb")) != NULL, "Open failed" ) &&
+  (img = ImageReadLayout(f, layout)) != NULL;
+
+  // Cleanup
+  if (!success) {
+    errsave = errno;
+    ImageDestroy(&img);
+    errno = errsave;
+  }
+  if (f != NULL) fclose(f);
+  return img;
+}
+
+/// Skip whitespace in stream f and check whether it has ended.
+/// Returns nonzero if no more data (no more frames) follow, or on a read
+/// error (distinguish with ferror(f)); returns 0 if a frame may follow.
+int ImageStreamEnd(FILE* f) { ///
+  assert (f != NULL);
+  int c;
+  while ((c = getc(f)) != EOF && isspace(c)) {}
+  if (c == EOF) return 1;
+  ungetc(c, f);
+  return 0;
+}
+
+/// Read one PGM image (raw or plain, as ImageLoad) from stream f.
+/// A stream may hold several images (frames), one after the other, as in
+/// the PGM specification; each call reads the next one, leaving f at the
+/// byte following its pixels.  Use ImageStreamEnd to detect the end.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly, and
+/// the position of f is undefined.
+Image ImageRead(FILE* f) { ///
+  return ImageReadLayout(f, IMAGE_RASTER);
+}
+
+/// Read one PGM image from stream f into an image with the given
+/// pixel layout.  Otherwise, as ImageRead.
+Image ImageReadLayout(FILE* f, ImageLayout layout) { ///
+  assert (f != NULL);
+  int w, h;
+  int maxval;
+  char format, c;
+  Image img = NULL;
+
+  int success = 
   // Parse PGM header
-  check( fscanf(f, "P%c ", &c) == 1 && c == '5' , "Invalid file format" ) &&
+  check( fscanf(f, " P%c ", &format) == 1 && (format == '5' || format == '2') , "Invalid file format" ) &&
   skipComments(f) >= 0 &&
   check( fscanf(f, "%d ", &w) == 1 && w >= 0 , "Invalid width" ) &&
   skipComments(f) >= 0 &&
   check( fscanf(f, "%d ", &h) == 1 && h >= 0 , "Invalid height" ) &&
   skipComments(f) >= 0 &&
-  check( fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= (int)PixMax , "Invalid maxval" ) &&
+  check( fscanf(f, "%d", &maxval) == 1 && 0 < maxval && maxval <= MAXVAL16 , "Invalid maxval" ) &&
   check( fscanf(f, "%c", &c) == 1 && isspace(c) , "Whitespace expected" ) &&
-  // Allocate image
-  (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
+  // Allocate image (16-bit samples are rescaled to PixMax)
+  (img = ImageCreateLayout(w, h, maxval > PixMax ? PixMax : (uint8)maxval, layout)) != NULL &&
   // Read pixels
-  check( fread(img->pixel, sizeof(uint8), w*h, f) == w*h , "Reading pixels" );
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  check( readPixels(img, f, format == '2', maxval) , "Reading pixels" );
+  if (img != NULL) PIXMEM += (unsigned long)w * h;  // count pixel memory accesses
 
   // Cleanup
   if (!success) {
@@ -251,7 +977,6 @@ Image ImageLoad(const char* filename) { ///
     ImageDestroy(&img);
     errno = errsave;
   }
-  if (f != NULL) fclose(f);
   return img;
 }
 
@@ -261,22 +986,145 @@ Image ImageLoad(const char* filename) { ///
 /// a partial and invalid file may be left in the system.
 int ImageSave(Image img, const char* filename) { ///
   assert (img != NULL);
+  FILE* f = NULL;
+
+  int success =
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  ImageWrite(img, f);
+
+  // Cleanup
+  if (f != NULL) fclose(f);
+  return success;
+}
+
+/// Write image to stream f, as one raw PGM frame.
+/// Frames written one after the other form a multi-image PGM stream
+/// (see ImageRead).  The stream is not flushed.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageWrite(Image img, FILE* f) { ///
+  assert (img != NULL);
+  assert (f != NULL);
   int w = img->width;
   int h = img->height;
   uint8 maxval = img->maxval;
+  materialize(img);
+
+  int success =
+  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
+  check( writePixels(img, f), "Writing pixels failed" ); 
+  PIXMEM += (unsigned long)w * h;  // count pixel memory accesses
+  return success;
+}
+
+/// Save image to PGM file with 16-bit samples (see ImageWrite16).
+/// Otherwise, as ImageSave.
+int ImageSave16(Image img, const char* filename, int maxval) { ///
+  assert (img != NULL);
   FILE* f = NULL;
 
   int success =
   check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
-  check( fprintf(f, "P5\n%d %d\n%u\n", w, h, maxval) > 0, "Writing header failed" ) &&
-  check( fwrite(img->pixel, sizeof(uint8), w*h, f) == w*h, "Writing pixels failed" ); 
-  PIXMEM += (unsigned long)(w*h);  // count pixel memory accesses
+  ImageWrite16(img, f, maxval);
 
   // Cleanup
   if (f != NULL) fclose(f);
   return success;
 }
 
+/// Write image to stream f, as one raw PGM frame with 16-bit samples
+/// (big-endian, two bytes each) and the given maxval.
+/// Levels are rescaled from [0, maxval of img] to [0, maxval], rounded
+/// to the nearest level.
+/// Requires: PixMax < maxval <= 65535.
+/// Otherwise, as ImageWrite.
+int ImageWrite16(Image img, FILE* f, int maxval) { ///
+  assert (img != NULL);
+  assert (f != NULL);
+  assert (PixMax < maxval && maxval <= MAXVAL16);
+  int w = img->width;
+  int h = img->height;
+  materialize(img);
+
+  int success =
+  check( fprintf(f, "P5\n%d %d\n%d\n", w, h, maxval) > 0, "Writing header failed" ) &&
+  check( writePixels16(img, f, maxval), "Writing pixels failed" );
+  PIXMEM += (unsigned long)w * h;  // count pixel memory accesses
+  return success;
+}
+
+
+/// Asynchronous save
+
+// A save job: the snapshot being written by its thread, and the outcome.
+struct imageSaveJob {
+  pthread_t thread;
+  Image snap;        // destroyed by the thread when written
+  char* filename;
+  int success;       // ImageSave's result, and the errno/errCause it left
+  int errnum;
+  char* cause;
+};
+
+static void* saveThread(void* arg) {
+  ImageSaveJob job = arg;
+  job->success = ImageSave(job->snap, job->filename);
+  job->errnum = errno;
+  job->cause = errCause;
+  ImageDestroy(&job->snap);
+  return NULL;
+}
+
+/// Save image to PGM file in the background.
+/// A snapshot (copy) of img is taken before returning, so img may be
+/// modified or destroyed right away, while a new thread writes the
+/// snapshot to filename.
+/// On success, returns a handle, which must be passed to ImageSaveWait.
+/// On failure (no memory for the snapshot, or no thread), returns NULL
+/// and errno/errCause are set accordingly; nothing is written.
+ImageSaveJob ImageSaveAsync(Image img, const char* filename) { ///
+  assert (img != NULL);
+  assert (filename != NULL);
+  ImageSaveJob job = (ImageSaveJob)malloc(sizeof(struct imageSaveJob));
+  if (!check( job != NULL, "Allocating save job failed" )) {
+    return NULL;
+  }
+  job->filename = NULL;
+  int rc = 0;
+  int success =
+  check( (job->filename = strdup(filename)) != NULL, "Allocating save job failed" ) &&
+  (job->snap = ImageCrop(img, 0, 0, img->width, img->height)) != NULL &&
+  check( (rc = pthread_create(&job->thread, NULL, saveThread, job)) == 0, "Creating thread failed" );
+  if (!success) {
+    errsave = rc != 0 ? rc : errno;
+    if (rc != 0) ImageDestroy(&job->snap);
+    free(job->filename);
+    free(job);
+    errno = errsave;
+    return NULL;
+  }
+  return job;
+}
+
+/// Wait for the save job (*jobp) to finish, and release it.
+/// Returns what ImageSave would have returned: on success, nonzero (and
+/// errno/errCause are left unchanged); on failure, 0, with errno/errCause
+/// set as ImageSave left them.
+/// Ensures: (*jobp)==NULL.
+int ImageSaveWait(ImageSaveJob* jobp) { ///
+  assert (jobp != NULL && *jobp != NULL);
+  ImageSaveJob job = *jobp;
+  pthread_join(job->thread, NULL);
+  int success = job->success;
+  errsave = success ? errno : job->errnum;
+  if (!success) errCause = job->cause;
+  free(job->filename);
+  free(job);
+  *jobp = NULL;
+  errno = errsave;
+  return success;
+}
+
 
 /// Information queries
 
@@ -308,18 +1156,43 @@ int ImageMaxval(Image img) { ///
 void ImageStats(Image img, uint8* min, uint8* max) { ///
   assert (img != NULL);
   assert (img->pixel != NULL);
-  *min = 255;  // Defined in limits.h
-  *max = 0;
-  // Iterating pixel by pixel and storing the current minimum and maximum gray levels in the respective pointers
-  for (int i = 0; i < img->width * img->height; ++i) {
-        uint8 pixelGV = img->pixel[i];
-        if (pixelGV < *min) {
-            *min = pixelGV;
-        }
-        if (pixelGV > *max) {
-            *max = pixelGV;
-        }
+  // Pixel order does not matter, so views are read in src order.
+  int t;
+  const uint8* p = viewSrc(img, &t)->pixel;
+  size_t size = (size_t)img->width * img->height;
+  K->minMax(p, size, min, max);
+  PIXMEM += (unsigned long)size;
+}
+
+// Number of interleaved sub-histograms used by ImageHistogram.
+#define HIST_WAYS 4
+
+/// Gray level histogram.
+/// On return, hist[v] is the number of pixels with level v, for v in 0..255.
+void ImageHistogram(Image img, uint64_t hist[256]) { ///
+  assert (img != NULL);
+  assert (hist != NULL);
+  // Consecutive pixels often share a level; incrementing a single table
+  // would then serialize on store-to-load forwarding of the same counter.
+  // Spreading consecutive pixels over HIST_WAYS tables breaks that chain.
+  uint64_t sub[HIST_WAYS][256] = {{0}};
+  int t;
+  const uint8* p = viewSrc(img, &t)->pixel;  // order does not matter
+  size_t size = (size_t)img->width * img->height;
+  size_t i = 0;
+  for (; i + HIST_WAYS <= size; i += HIST_WAYS) {
+    sub[0][p[i]]++;
+    sub[1][p[i+1]]++;
+    sub[2][p[i+2]]++;
+    sub[3][p[i+3]]++;
+  }
+  for (; i < size; i++) {
+    sub[0][p[i]]++;
+  }
+  for (int v = 0; v < 256; v++) {
+    hist[v] = sub[0][v] + sub[1][v] + sub[2][v] + sub[3][v];
   }
+  PIXMEM += (unsigned long)size;
 }
 
 /// Check if pixel position (x,y) is inside img.
@@ -331,7 +1204,8 @@ int ImageValidPos(Image img, int x, int y) { ///
 /// Check if rectangular area (x,y,w,h) is completely inside img.
 int ImageValidRect(Image img, int x, int y, int w, int h) { ///
   assert (img != NULL);
-  return (x >= 0 && y >= 0 && x + w <= img->width && y + h <= img->height);
+  // Compared as w <= width-x (not x+w <= width), which cannot overflow
+  return (x >= 0 && y >= 0 && w <= img->width - x && h <= img->height - y);
 }
 
 /// Pixel get & set operations
@@ -344,12 +1218,11 @@ int ImageValidRect(Image img, int x, int y, int w, int h) { ///
 // Transform (x, y) coords into linear pixel index.
 // This internal function is used in ImageGetPixel / ImageSetPixel. 
 // The returned index must satisfy (0 <= index < img->width*img->height)
-static inline int G(Image img, int x, int y) {
-  int index;
-  // Since we're working with a 1-based index
+static inline size_t G(Image img, int x, int y) {
+  size_t index;
   assert(x >= 0 && x < img->width && y >= 0 && y < img->height);
-  index = ((y-1) * img->width) + x;
-  assert (0 <= index && index < img->width*img->height);
+  index = pixIndex(img, x, y);
+  assert (index < (size_t)img->width * img->height);
   return index;
 }
 
@@ -358,6 +1231,9 @@ uint8 ImageGetPixel(Image img, int x, int y) { ///
   assert (img != NULL);
   assert (ImageValidPos(img, x, y));
   PIXMEM += 1;  // count one pixel access (read)
+  if (img->src != NULL) {  // read through the view
+    return img->src->pixel[orientIndex(img->src, img->orient, x, y)];
+  }
   return img->pixel[G(img, x, y)];
 } 
 
@@ -366,6 +1242,7 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
   assert (img != NULL);
   assert (ImageValidPos(img, x, y));
   PIXMEM += 1;  // count one pixel access (store)
+  unshare(img);
   img->pixel[G(img, x, y)] = level;
 } 
 
@@ -378,14 +1255,51 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
 /// They never fail.
 
 
+// Apply a level mapping to the pixels of the rectangle (x,y,w,h) only:
+// p = lut[p].  Rows are visited by contiguous spans, for either layout.
+static void applyLUTRect(Image img, int x, int y, int w, int h, const uint8 lut[256]) {
+  assert (ImageValidRect(img, x, y, w, h));
+  unshare(img);
+  for (int i = y; i < y + h; i++) {
+    for (int j = x; j < x + w; ) {
+      int n;
+      uint8* p = rowSpan(img, j, i, &n);
+      n = n < x + w - j ? n : x + w - j;
+      for (int k = 0; k < n; k++) p[k] = lut[p[k]];
+      j += n;
+    }
+  }
+  PIXMEM += 2ul * w * h;
+}
+
+// Apply a level mapping to every pixel: p = lut[p].
+static void applyLUT(Image img, const uint8 lut[256]) {
+  unshare(img);
+  uint8* p = img->pixel;
+  size_t size = (size_t)img->width * img->height;
+  for (size_t i = 0; i < size; i++) {
+    p[i] = lut[p[i]];
+  }
+  PIXMEM += 2ul * size;
+}
+
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
 /// resulting in a "photographic negative" effect.
 void ImageNegative(Image img) { ///
   assert (img != NULL);
-  for(int i = 0; i < img->width * img->height; i++) {
-    img->pixel[i] = 255 - img->pixel[i];
-  }
+  unshare(img);
+  K->negate(img->pixel, (size_t)img->width * img->height, img->maxval);
+  PIXMEM += 2ul * img->width * img->height;  // read and write
+}
+
+/// Transform the rectangle (x,y,w,h) of img to negative, as ImageNegative.
+/// Requires: the rectangle must be inside img.
+void ImageNegativeRect(Image img, int x, int y, int w, int h) { ///
+  assert (img != NULL);
+  uint8 lut[256];
+  for (int v = 0; v < 256; v++) lut[v] = (uint8)(img->maxval - v);
+  applyLUTRect(img, x, y, w, h, lut);
 }
 
 /// Apply threshold to image.
@@ -393,14 +1307,18 @@ void ImageNegative(Image img) { ///
 /// all pixels with level>=thr to white (maxval).
 void ImageThreshold(Image img, uint8 thr) { ///
   assert (img != NULL);
-  for(int i = 0; i < img->width * img->height; i++) {
-    if (img->pixel[i] < thr){
-      img->pixel[i] = 0;
-    }
-    else {
-      img->pixel[i] = img->maxval;
-    }
-  }
+  unshare(img);
+  K->threshold(img->pixel, (size_t)img->width * img->height, thr, img->maxval);
+  PIXMEM += 2ul * img->width * img->height;  // read and write
+}
+
+/// Apply threshold to the rectangle (x,y,w,h) of img, as ImageThreshold.
+/// Requires: the rectangle must be inside img.
+void ImageThresholdRect(Image img, int x, int y, int w, int h, uint8 thr) { ///
+  assert (img != NULL);
+  uint8 lut[256];
+  for (int v = 0; v < 256; v++) lut[v] = v < thr ? 0 : img->maxval;
+  applyLUTRect(img, x, y, w, h, lut);
 }
 
 /// Brighten image by a factor.
@@ -410,15 +1328,75 @@ void ImageThreshold(Image img, uint8 thr) { ///
 void ImageBrighten(Image img, double factor) { ///
   assert (img != NULL);
   assert (factor >= 0.0);
-  for(int i = 0; i < img->width * img->height; i++) {
-    if (img->pixel[i] * factor <= img->maxval) {
-      img->pixel[i] = img->pixel[i] * factor;
-    }
-    // Saturates pixels at maxval
-    else {
-      img->pixel[i] = img->maxval;
-    }
+  unshare(img);
+  // Saturates pixels at maxval
+  K->brighten(img->pixel, (size_t)img->width * img->height, factor, img->maxval);
+  PIXMEM += 2ul * img->width * img->height;  // read and write
+}
+
+/// Brighten the rectangle (x,y,w,h) of img by a factor, as ImageBrighten.
+/// Requires: the rectangle must be inside img.
+void ImageBrightenRect(Image img, int x, int y, int w, int h, double factor) { ///
+  assert (img != NULL);
+  assert (factor >= 0.0);
+  uint8 lut[256];
+  for (int v = 0; v < 256; v++) {
+    lut[v] = v * factor <= img->maxval ? (uint8)(v * factor) : img->maxval;
+  }
+  applyLUTRect(img, x, y, w, h, lut);
+}
+
+/// Stretch contrast to the full range [0, maxval].
+/// Levels are mapped linearly so that the level below which a fraction clip
+/// of the pixels lies becomes 0, and the level above which a fraction clip
+/// lies becomes maxval (clip = 0.0 uses the actual min and max levels).
+/// Requires: 0.0 <= clip < 0.5.
+void ImageAutoContrast(Image img, double clip) { ///
+  assert (img != NULL);
+  assert (0.0 <= clip && clip < 0.5);
+  uint64_t hist[256];
+  ImageHistogram(img, hist);
+  uint64_t total = (uint64_t)img->width * img->height;
+  uint64_t cut = (uint64_t)(clip * total);
+  // Find lo and hi: the levels where the clipped tails end
+  int lo = 0, hi = 255;
+  uint64_t cum = 0;
+  while (lo < 255 && (cum += hist[lo]) <= cut) lo++;
+  cum = 0;
+  while (hi > 0 && (cum += hist[hi]) <= cut) hi--;
+  if (lo >= hi) return;  // uniform image (or clipped to nothing): no contrast to stretch
+  uint8 lut[256];
+  int maxval = img->maxval;
+  for (int v = 0; v < 256; v++) {
+    if (v <= lo) lut[v] = 0;
+    else if (v >= hi) lut[v] = maxval;
+    else lut[v] = (uint8)(((v - lo) * maxval * 2 + (hi - lo)) / (2 * (hi - lo)));
+  }
+  applyLUT(img, lut);
+}
+
+/// Equalize the histogram.
+/// Levels are remapped through the normalized cumulative histogram, so
+/// that the result's levels are spread as uniformly as possible over
+/// [0, maxval].
+void ImageEqualize(Image img) { ///
+  assert (img != NULL);
+  uint64_t hist[256];
+  ImageHistogram(img, hist);
+  uint64_t total = (uint64_t)img->width * img->height;
+  // Pixels at the lowest level present map to 0
+  uint64_t cdfmin = 0;
+  for (int v = 0; v < 256 && cdfmin == 0; v++) cdfmin = hist[v];
+  if (total == cdfmin) return;  // a single level: nothing to spread
+  uint8 lut[256];
+  uint64_t cdf = 0;
+  uint64_t range = total - cdfmin;
+  for (int v = 0; v < 256; v++) {
+    cdf += hist[v];
+    lut[v] = cdf <= cdfmin ? 0 :
+             (uint8)(((cdf - cdfmin) * img->maxval * 2 + range) / (2 * range));
   }
+  applyLUT(img, lut);
 }
 
 
@@ -445,30 +1423,29 @@ void ImageBrighten(Image img, double factor) { ///
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img) { ///
   assert (img != NULL);
-  Image rotated = ImageCreate(img->height, img->width, 255);
-    if (rotated->pixel == NULL) {
-        fprintf(stderr, "Error: Memory allocation failed for rotated image.\n");
-        exit(1);
-    }
+  return orientView(img, ORIENT_T | ORIENT_FX);
+}
 
-    // Rotate the image
-    for (int y = 0; y < img->height; ++y) {
-        for (int x = 0; x < img->width; ++x) {
-            // Calculate the rotated coordinates
-            int xNew = y;
-            int yNew = img->width - 1 - x;
+/// Rotate an image 180 degrees.
+/// Otherwise, as ImageRotate.
+Image ImageRotate180(Image img) { ///
+  assert (img != NULL);
+  return orientView(img, ORIENT_FX | ORIENT_FY);
+}
 
-            // Calculate linear indices for both images (using the G function was generating discrepancies between images)
-            int imgIndex = y * img->width + x;
-            int rotatedIndex = yNew * rotated->width + xNew;
+/// Rotate an image 270 degrees anti-clockwise (90 degrees clockwise).
+/// Otherwise, as ImageRotate.
+Image ImageRotate270(Image img) { ///
+  assert (img != NULL);
+  return orientView(img, ORIENT_T | ORIENT_FY);
+}
 
-            // Copy pixel value from the original to the rotated image
-            rotated->pixel[rotatedIndex] = img->pixel[imgIndex];
-        }
-    }
-
-    return rotated;
-  
+/// Transpose an image = flip about the main diagonal: pixel (x,y) of the
+/// result is pixel (y,x) of img.
+/// Otherwise, as ImageRotate.
+Image ImageTranspose(Image img) { ///
+  assert (img != NULL);
+  return orientView(img, ORIENT_T);
 }
 
 /// Mirror an image = flip left-right.
@@ -480,25 +1457,14 @@ Image ImageRotate(Image img) { ///
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageMirror(Image img) { ///
   assert (img != NULL);
-  Image mirrored = ImageCreate(img->width, img->height, 255);
-    if (mirrored->pixel == NULL) {
-        fprintf(stderr, "Error: Memory allocation failed for rotated image.\n");
-        exit(1);
-    }
-    // Mirror the image
-    for (int y = 0; y < img->height; ++y) {
-        for (int x = 0; x < img->width; ++x) {
-            // Calculate linear indices for both images
-            int imgIndex = y * img->width + x;
-            int mirroredIndex = y * mirrored->width + (img->width - 1 - x);
-
-            // Copy pixel value from the original to the mirrored image
-            mirrored->pixel[mirroredIndex] = img->pixel[imgIndex];
-        }
-    }
-
-    return mirrored;
+  return orientView(img, ORIENT_FX);
+}
 
+/// Flip an image top-bottom.
+/// Otherwise, as ImageMirror.
+Image ImageFlip(Image img) { ///
+  assert (img != NULL);
+  return orientView(img, ORIENT_FY);
 }
 
 /// Crop a rectangular subimage from img.
@@ -516,25 +1482,207 @@ Image ImageMirror(Image img) { ///
 Image ImageCrop(Image img, int x, int y, int w, int h) { ///
   assert (img != NULL);
   assert (ImageValidRect(img, x, y, w, h));
-  Image cropped = ImageCreate(w, h, 255);
-  if (cropped->pixel == NULL) {
-        fprintf(stderr, "Error: Memory allocation failed for cropped image.\n");
-        exit(1);  // or return an error code
-  }
-  // Crop the image
-  for (int i = 0; i < h; ++i) {
-        for (int j = 0; j < w; ++j) {
-            // Calculate linear indices for both images
-            int imgIndex = (y + i) * img->width + (x + j);
-            int croppedIndex = i * w + j;
-            // Copy pixel value from the original to the cropped image
-            cropped->pixel[croppedIndex] = img->pixel[imgIndex];
-        }
+  Image cropped = ImageCreateLayout(w, h, img->maxval, img->layout);
+  if (cropped == NULL) {
+        return NULL;
   }
+  // Copy through img's orientation: no need to materialize it
+  int t;
+  Image src = viewSrc(img, &t);
+  orientCopy(cropped, 0, 0, src, t, x, y, w, h);
   return cropped;
   
 }
 
+// Resize coefficients: weights in Q14; the vertical pass keeps sums in Q6
+// (shifting out 8 bits), the horizontal pass returns to levels.
+#define RESIZE_SHIFT 14
+#define RESIZE_ONE (1 << RESIZE_SHIFT)
+#define RESIZE_VSHIFT 8
+#define RESIZE_VHALF (1 << (RESIZE_VSHIFT - 1))
+#define RESIZE_HSHIFT (2 * RESIZE_SHIFT - RESIZE_VSHIFT)
+#define RESIZE_HHALF (1 << (RESIZE_HSHIFT - 1))
+
+// Coefficients of a 1D resampling of srcLen samples to dstLen samples:
+// output i is the sum over k < taps of input start[i]+k times
+// wt[k*dstLen+i].  Every output has the same number of taps (unused ones
+// weigh 0), and weights are stored tap by tap, so kernels run one
+// contiguous loop per tap; the weights of each output sum to RESIZE_ONE.
+typedef struct {
+  int taps;
+  int32_t* start;
+  int32_t* wt;
+} ResizeCoefs;
+
+// Compute the coefficients of a resampling in mode (sample centers are
+// aligned: output i is centered at input (i+0.5)*srcLen/dstLen - 0.5).
+// Nearest takes the input sample containing that center; bilinear
+// interpolates the two nearest samples; area averages the inputs covered
+// by the output, weighted by their overlap.
+// Returns nonzero on success; on failure, the caller frees what was
+// allocated (with resizeCoefsFree).
+static int resizeCoefs(ResizeCoefs* c, int srcLen, int dstLen, ImageResizeMode mode) {
+  double scale = (double)srcLen / dstLen;
+  int taps = mode == IMAGE_RESIZE_NEAREST ? 1 :
+             mode == IMAGE_RESIZE_BILINEAR || scale < 1.0 ? 2 : (int)ceil(scale) + 1;
+  if (taps > srcLen) taps = srcLen;
+  c->taps = taps;
+  c->start = malloc(dstLen * sizeof(int32_t));
+  c->wt = calloc((size_t)dstLen * taps, sizeof(int32_t));
+  double* w = malloc((taps + 1) * sizeof(double));
+  if (c->start == NULL || c->wt == NULL || w == NULL) {
+    free(w);
+    return 0;
+  }
+  for (int i = 0; i < dstLen; i++) {
+    int s = 0;
+    int n = 1;
+    w[0] = 1.0;
+    if (mode == IMAGE_RESIZE_NEAREST) {
+      s = (int)((2 * (int64_t)i + 1) * srcLen / (2 * (int64_t)dstLen));
+    } else if (mode == IMAGE_RESIZE_BILINEAR) {
+      double x = (i + 0.5) * scale - 0.5;
+      x = x < 0.0 ? 0.0 : (x > srcLen - 1 ? srcLen - 1 : x);
+      s = (int)x;
+      if (s + 1 < srcLen) {
+        n = 2;
+        w[0] = 1.0 - (x - s);
+        w[1] = x - s;
+      }
+    } else {
+      double a = i * scale;
+      double b = (i + 1) * scale;
+      s = (int)a;
+      n = 0;
+      for (int p = s; p < b && p < srcLen && n <= taps; p++) {
+        w[n++] = ((b < p + 1 ? b : p + 1) - (a > p ? a : p)) / scale;
+      }
+      if (n > taps) n = taps;   // a sliver past the last tap, from rounding
+    }
+    // Clamp the first tap, so all taps fall inside the input
+    int first = s < srcLen - taps ? s : srcLen - taps;
+    int32_t* wi = c->wt + (size_t)(s - first) * dstLen + i;   // wi[k*dstLen]: tap k
+    int32_t sum = 0;
+    int big = 0;
+    for (int k = 0; k < n; k++) {
+      wi[k * dstLen] = (int32_t)lround(w[k] * RESIZE_ONE);
+      sum += wi[k * dstLen];
+      if (wi[k * dstLen] > wi[big * dstLen]) big = k;
+    }
+    wi[big * dstLen] += RESIZE_ONE - sum;   // exact sum, so flat areas stay flat
+    c->start[i] = first;
+  }
+  free(w);
+  return 1;
+}
+
+static void resizeCoefsFree(ResizeCoefs* c) {
+  free(c->start);
+  free(c->wt);
+}
+
+typedef struct {
+  Image src;
+  Image dst;
+  ImageResizeMode mode;
+  ResizeCoefs cx, cy;   // horizontal and vertical coefficients
+  int rowsPer;          // output rows per strip
+  int failed;           // set by a strip that could not allocate
+} ResizeJob;
+
+// Compute strip s of output rows: the vertical pass of each row into a
+// scratch row (over the source rows of nonzero weight), then the
+// horizontal pass into the output.
+static void resizeStrip(void* ctx, int s) {
+  ResizeJob* job = ctx;
+  size_t sw = job->src->width;
+  size_t dw = job->dst->width;
+  int y0 = s * job->rowsPer;
+  int y1 = y0 + job->rowsPer < job->dst->height ? y0 + job->rowsPer : job->dst->height;
+  const ResizeCoefs* cx = &job->cx;
+  const ResizeCoefs* cy = &job->cy;
+  if (job->mode == IMAGE_RESIZE_NEAREST) {
+    for (int y = y0; y < y1; y++) {
+      const uint8* r = job->src->pixel + cy->start[y] * sw;
+      uint8* d = job->dst->pixel + y * dw;
+      for (size_t j = 0; j < dw; j++) d[j] = r[cx->start[j]];
+    }
+    return;
+  }
+  uint16* t = malloc(sw * sizeof(uint16));
+  uint32_t* acc = malloc((sw > dw ? sw : dw) * sizeof(uint32_t));
+  const uint8** rows = malloc(cy->taps * sizeof(uint8*));
+  int32_t* wt = malloc(cy->taps * sizeof(int32_t));
+  if (t == NULL || acc == NULL || rows == NULL || wt == NULL) {
+    job->failed = 1;
+  } else {
+    size_t dh = job->dst->height;
+    for (int y = y0; y < y1; y++) {
+      int m = 0;
+      for (int k = 0; k < cy->taps; k++) {
+        if (cy->wt[k * dh + y] == 0) continue;
+        rows[m] = job->src->pixel + (cy->start[y] + k) * sw;
+        wt[m++] = cy->wt[k * dh + y];
+      }
+      K->resizeCol(t, acc, rows, wt, m, sw);
+      K->resizeRow(job->dst->pixel + y * dw, acc, t, cx->start, cx->wt, cx->taps, dw);
+    }
+  }
+  free(wt);
+  free(rows);
+  free(acc);
+  free(t);
+}
+
+/// Resize an image to width w and height h, resampling in mode:
+///   IMAGE_RESIZE_NEAREST: each pixel copies the nearest source pixel;
+///   IMAGE_RESIZE_BILINEAR: interpolates the 2x2 nearest source pixels;
+///   IMAGE_RESIZE_AREA: averages the source pixels the new pixel covers,
+///     weighted by their covered area (best for shrinking).
+/// Filters run separably in fixed point (results may differ from exact
+/// arithmetic by one level), on strips of rows in parallel (see
+/// ImageSetThreads).
+/// Requires: img is not empty; w > 0; h > 0.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned, with the maxval and layout of img.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h, ImageResizeMode mode) { ///
+  assert (img != NULL);
+  assert (img->width > 0 && img->height > 0);
+  assert (w > 0 && h > 0);
+  assert (IMAGE_RESIZE_NEAREST <= mode && mode <= IMAGE_RESIZE_AREA);
+  ResizeJob job = { img, NULL, mode, { 0, NULL, NULL }, { 0, NULL, NULL }, 0, 0 };
+
+  int success =
+  (job.dst = ImageCreate(w, h, img->maxval)) != NULL &&
+  check( resizeCoefs(&job.cx, img->width, w, mode) &&
+         resizeCoefs(&job.cy, img->height, h, mode), "Allocating coefficients failed" );
+  if (success) {
+    materialize(img);
+    ImageLayout was = untile(img);
+    // Strips of at least 16 rows, at most 4 per thread for load balance
+    int nstrips = nThreads * 4;
+    if (nstrips > (h + 15) / 16) nstrips = (h + 15) / 16;
+    job.rowsPer = (h + nstrips - 1) / nstrips;
+    parallelFor(nstrips, resizeStrip, &job);
+    retile(img, was);
+    success = check( !job.failed, "Allocating rows failed" );
+    PIXMEM += (unsigned long)h * job.cy.taps * img->width + (unsigned long)w * h;  // rows read, and write
+  }
+  success = success &&
+  (img->layout == IMAGE_RASTER || ImageSetLayout(job.dst, img->layout));
+
+  // Cleanup
+  errsave = errno;
+  resizeCoefsFree(&job.cx);
+  resizeCoefsFree(&job.cy);
+  if (!success) ImageDestroy(&job.dst);
+  errno = errsave;
+  return job.dst;
+}
+
 
 /// Operations on two images
 
@@ -546,48 +1694,393 @@ void ImagePaste(Image img1, int x, int y, Image img2) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidRect(img1, x, y, img2->width, img2->height));
-  // Copy pixel values from img2 to img1
-    for (int i = 0; i < img2->height; ++i) {
-        for (int j = 0; j < img2->width; ++j) {
-            // Calculate linear indices for both images
-            int img1Index = (y + i) * img1->width + (x + j);
-            int img2Index = i * img2->width + j;
-
-            // Paste pixel value from img2 to img1
-            img1->pixel[img1Index] = img2->pixel[img2Index];
-        }
+  unshare(img1);
+  // Copy through img2's orientation: no need to materialize it
+  int t;
+  Image src = viewSrc(img2, &t);
+  orientCopy(img1, x, y, src, t, 0, 0, img2->width, img2->height);
+}
+
+// Destination rows per band in ImagePasteMany
+#define PASTE_BAND 64
+
+typedef struct {
+  Image img;
+  const ImagePlacement* places;
+  const int* first;   // placements of band b: list[first[b]..first[b+1]-1]
+  const int* list;    // placement indices, by band, in their original order
+} PasteJob;
+
+// Paste the rows of band b: each placement's rows inside the band, in
+// order, so later placements overwrite earlier ones.
+static void pasteBand(void* ctx, int b) {
+  PasteJob* job = ctx;
+  Image img = job->img;
+  int y0 = b * PASTE_BAND;
+  int y1 = y0 + PASTE_BAND < img->height ? y0 + PASTE_BAND : img->height;
+  for (int i = job->first[b]; i < job->first[b + 1]; i++) {
+    const ImagePlacement* P = &job->places[job->list[i]];
+    int w = P->img->width;
+    int ya = P->y > y0 ? P->y : y0;
+    int yb = P->y + P->img->height < y1 ? P->y + P->img->height : y1;
+    for (int y = ya; y < yb; y++) {
+      memcpy(img->pixel + (size_t)y * img->width + P->x,
+             P->img->pixel + (size_t)(y - P->y) * w, w);
     }
+  }
 }
 
+/// Paste several images into img.
+/// The result is the same as pasting places[0], places[1], ...,
+/// places[n-1] into img in this order (where placements overlap, the last
+/// one wins), but placements are sorted by destination band of rows, and
+/// bands are pasted by row copies, in parallel (see ImageSetThreads).
+/// This modifies img in-place.  (If the band lists cannot be allocated,
+/// images are pasted one by one: slower, same result.)
+/// Requires: every image must fit inside img at its position, and none
+/// may be img itself.
+void ImagePasteMany(Image img, const ImagePlacement* places, int n) { ///
+  assert (img != NULL);
+  assert (n == 0 || places != NULL);
+  int nbands = (img->height + PASTE_BAND - 1) / PASTE_BAND;
+  // Number of (band, placement) pairs
+  size_t total = 0;
+  for (int i = 0; i < n; i++) {
+    const ImagePlacement* P = &places[i];
+    assert (P->img != NULL && P->img != img);
+    assert (ImageValidRect(img, P->x, P->y, P->img->width, P->img->height));
+    if (P->img->width > 0 && P->img->height > 0) {
+      total += (P->y + P->img->height - 1) / PASTE_BAND - P->y / PASTE_BAND + 1;
+    }
+  }
+  // One block for band starts, the band lists, and the images' layouts
+  int* first = NULL;
+  if (total <= INT_MAX) {
+    first = malloc((nbands + 1 + total) * sizeof(int) + (n + 1) * sizeof(ImageLayout));
+  }
+  if (first == NULL) {
+    for (int i = 0; i < n; i++) {
+      ImagePaste(img, places[i].x, places[i].y, places[i].img);
+    }
+    return;
+  }
+  int* list = first + nbands + 1;
+  ImageLayout* wasImg = (ImageLayout*)(list + total);
+  unshare(img);
+
+  // Counting sort of placements by band (stable: original order in each):
+  // count band b in first[b+1], sum so first[b] starts band b, fill band b
+  // advancing first[b] to its end, then shift back to the starts.
+  memset(first, 0, (nbands + 1) * sizeof(int));
+  unsigned long pixels = 0;
+  for (int i = 0; i < n; i++) {
+    const ImagePlacement* P = &places[i];
+    if (P->img->width == 0 || P->img->height == 0) continue;
+    for (int b = P->y / PASTE_BAND; b <= (P->y + P->img->height - 1) / PASTE_BAND; b++) {
+      first[b + 1]++;
+    }
+    pixels += (unsigned long)P->img->width * P->img->height;
+  }
+  for (int b = 0; b < nbands; b++) first[b + 1] += first[b];
+  for (int i = 0; i < n; i++) {
+    const ImagePlacement* P = &places[i];
+    if (P->img->width == 0 || P->img->height == 0) continue;
+    for (int b = P->y / PASTE_BAND; b <= (P->y + P->img->height - 1) / PASTE_BAND; b++) {
+      list[first[b]++] = i;
+    }
+  }
+  for (int b = nbands; b > 0; b--) first[b] = first[b - 1];
+  first[0] = 0;
+
+  // Layouts to restore, in reverse order (an image may appear repeatedly)
+  ImageLayout was = untile(img);
+  for (int i = 0; i < n; i++) {
+    materialize(places[i].img);
+    wasImg[i] = untile(places[i].img);
+  }
+  PasteJob job = { img, places, first, list };
+  parallelFor(nbands, pasteBand, &job);
+  PIXMEM += 2ul * pixels;  // read and write each pasted pixel
+  for (int i = n - 1; i >= 0; i--) {
+    retile(places[i].img, wasImg[i]);
+  }
+  retile(img, was);
+  free(first);
+}
+
+// Reference blend of one pixel pair, in double precision.
+// The result is saturated to [0, maxval] and rounded to the nearest level.
+// This defines the exact output of ImageBlend; the fixed-point kernel
+// below falls back to it whenever its own rounding might differ.
+static inline uint8 blendRef(uint8 p1, uint8 p2, double alpha, int maxval) {
+  double v = (1.0 - alpha) * p1 + alpha * p2;
+  if (v < 0.0) v = 0.0;
+  if (v > maxval) v = maxval;
+  return (uint8)(v + 0.5);
+}
+
+// Fixed-point blend format: alpha is held in Q16.
+#define BLEND_SHIFT 16
+#define BLEND_ONE (1 << BLEND_SHIFT)
+#define BLEND_HALF (1 << (BLEND_SHIFT - 1))
+#define BLEND_FRAC (BLEND_ONE - 1)
+// Largest |alpha| for which A*(p2-p1) cannot overflow an int32.
+#define BLEND_MAXALPHA 64.0
+
+// Blend one row with blendRef, for alphas outside the fixed-point range.
+// If rm is not NULL, pixel j is weighted by alpha*rm[j]/mmax instead.
+static void blendRowRef(uint8* r1, const uint8* r2, const uint8* rm, int n,
+                        double alpha, int mmax, int maxval) {
+  for (int j = 0; j < n; j++) {
+    double a = rm == NULL ? alpha : alpha * rm[j] / mmax;
+    r1[j] = blendRef(r1[j], r2[j], a, maxval);
+  }
+}
+
+// Pixels per chunk in blendRow (a chunk's results live on the stack).
+#define BLEND_CHUNK 256
+
+// Pixels per block in the comparison kernels (firstDiff, diffStats).
+#define DIFF_BLOCK 256
+
+// Compile the kernels for each level.  The scalar level disables the
+// vectorizer, as a reference and a fallback for any CPU.
+// Floating-point contraction is disabled for all levels: AVX-512 implies
+// FMA, and fusing blendRef's multiply-add would change its rounding.
+#pragma GCC push_options
+#pragma GCC optimize ("no-tree-vectorize")
+#define KLEVEL scalar
+#include "image8bitKernels.inc"
+#undef KLEVEL
+#pragma GCC pop_options
+
+#if KERNELS_X86
+#pragma GCC push_options
+#pragma GCC optimize ("fp-contract=off")
+#pragma GCC target ("sse4.1")
+#define KLEVEL sse4
+#include "image8bitKernels.inc"
+#undef KLEVEL
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC optimize ("fp-contract=off")
+#pragma GCC target ("avx2")
+#define KLEVEL avx2
+#include "image8bitKernels.inc"
+#undef KLEVEL
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC optimize ("fp-contract=off")
+#pragma GCC target ("avx512f,avx512bw,prefer-vector-width=512")
+#define KLEVEL avx512
+#include "image8bitKernels.inc"
+#undef KLEVEL
+#pragma GCC pop_options
+#endif
+
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
 /// This modifies img1 in-place: no allocation involved.
 /// Requires: img2 must fit inside img1 at position (x, y).
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
+/// Each result is (1-alpha)*p1 + alpha*p2, saturated to [0, maxval] of img1
+/// and rounded to the nearest level.
 void ImageBlend(Image img1, int x, int y, Image img2, double alpha) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidRect(img1, x, y, img2->width, img2->height));
-  // Blend pixels of img2 into img1
-    for (int i = 0; i < img2->height; ++i) {
-        for (int j = 0; j < img2->width; ++j) {
-            // Calculate linear indices for both images
-            int img1Index = (y + i) * img1->width + (x + j);
-            int img2Index = i * img2->width + j;
-
-            // Blend pixel values from img2 to img1
-            uint8 blendedValue = (1.0 - alpha) * img1->pixel[img1Index] + alpha * img2->pixel[img2Index];
-
-            // Saturate to avoid overflows and underflows
-            if (blendedValue >= img2->maxval) {
-              blendedValue = img2->maxval;
-            }
-            
-            // Update the pixel value in img1
-            img1->pixel[img1Index] = blendedValue;
-        }
+  unshare(img1);
+  materialize(img2);
+  ImageLayout was1 = untile(img1);
+  ImageLayout was2 = untile(img2);
+  int w = img2->width;
+  int h = img2->height;
+  int maxval = img1->maxval;
+  if (!(alpha >= -BLEND_MAXALPHA && alpha <= BLEND_MAXALPHA)) {
+    // Outside the fixed-point range: almost everything saturates anyway.
+    for (int i = 0; i < h; ++i) {
+      blendRowRef(img1->pixel + (size_t)(y + i) * img1->width + x,
+                  img2->pixel + (size_t)i * w, NULL, w, alpha, 1, maxval);
+    }
+  } else {
+    int32_t A = (int32_t)lround(alpha * BLEND_ONE);
+    // When alpha is exactly representable in Q16 no rounding can differ.
+    int32_t band = ((double)A == alpha * BLEND_ONE) ? 0 : 256;
+    for (int i = 0; i < h; ++i) {
+      K->blendRow(img1->pixel + (size_t)(y + i) * img1->width + x,
+               img2->pixel + (size_t)i * w, w, A, band, alpha, maxval);
+    }
+  }
+  PIXMEM += 3ul * w * h;  // 2 reads and 1 write per blended pixel
+  retile(img2, was2);
+  retile(img1, was1);
+}
+
+// Destination tile size for ImageComposite (16KiB, fits in L1 cache)
+#define COMP_TILEW 256
+#define COMP_TILEH 64
+
+// Fixed-point weights of layer L, as in ImageBlend.  Alphas outside the
+// fixed-point range use blendRef, signalled by *band < 0.
+static void compositeWeights(const ImageLayer* L, int32_t* A, int32_t* band, int32_t* Am) {
+  double alpha = L->alpha;
+  if (!(alpha >= -BLEND_MAXALPHA && alpha <= BLEND_MAXALPHA)) {
+    *A = *Am = 0;
+    *band = -1;
+    return;
+  }
+  *A = (int32_t)lround(alpha * BLEND_ONE);
+  *band = ((double)*A == alpha * BLEND_ONE) ? 0 : 256;
+  *Am = L->mask == NULL ? 0 :
+        (int32_t)lround(alpha * (BLEND_ONE << 8) / L->mask->maxval);
+}
+
+// Blend layer L into the rectangle [x0,x1)x[y0,y1) of img (inside L).
+static void compositeRect(Image img, const ImageLayer* L, int32_t A, int32_t band, int32_t Am,
+                          int x0, int y0, int x1, int y1) {
+  int maxval = img->maxval;
+  for (int y = y0; y < y1; y++) {
+    uint8* r1 = img->pixel + (size_t)y * img->width + x0;
+    size_t off = (size_t)(y - L->y) * L->img->width + (x0 - L->x);
+    if (band < 0) {
+      blendRowRef(r1, L->img->pixel + off,
+                  L->mask == NULL ? NULL : L->mask->pixel + off, x1 - x0,
+                  L->alpha, L->mask == NULL ? 1 : L->mask->maxval, maxval);
+    } else if (L->mask == NULL) {
+      K->blendRow(r1, L->img->pixel + off, x1 - x0, A, band, L->alpha, maxval);
+    } else {
+      K->blendMaskRow(r1, L->img->pixel + off, L->mask->pixel + off, x1 - x0, Am, maxval);
+    }
+  }
+  PIXMEM += (unsigned long)(L->mask == NULL ? 3 : 4) * (x1 - x0) * (y1 - y0);
+}
+
+/// Composite several layers into img in a single pass.
+/// The result is the same as blending layers[0], layers[1], ...,
+/// layers[n-1] into img in this order, but layers are sorted by row of
+/// tiles of img, and each tile is read and written only once for all the
+/// layers over it.
+/// This modifies img in-place.  (If the tile row lists cannot be
+/// allocated, layers are blended one by one: slower, same result.)
+/// Requires: every layer must fit inside img at its position,
+/// every mask must have the size of its layer, and no layer image or
+/// mask may be img itself.
+void ImageComposite(Image img, const ImageLayer* layers, int n) { ///
+  assert (img != NULL);
+  assert (n >= 0);
+  assert (n == 0 || layers != NULL);
+  if (n <= 0) return;
+  int nrows = (img->height + COMP_TILEH - 1) / COMP_TILEH;
+  // Number of (tile row, layer) pairs
+  size_t total = 0;
+  for (int l = 0; l < n; l++) {
+    const ImageLayer* L = &layers[l];
+    assert (L->img != NULL);
+    assert (L->img != img && L->mask != img);
+    assert (ImageValidRect(img, L->x, L->y, L->img->width, L->img->height));
+    assert (L->mask == NULL || (L->mask->width == L->img->width &&
+                                L->mask->height == L->img->height));
+    if (L->img->width > 0 && L->img->height > 0) {
+      total += (L->y + L->img->height - 1) / COMP_TILEH - L->y / COMP_TILEH + 1;
+    }
+  }
+  unshare(img);
+  ImageLayout was = untile(img);
+  // One block for row starts, the row lists, the per-layer weights, and
+  // the layers' layouts
+  int* first = NULL;
+  if (total <= INT_MAX) {
+    first = malloc((nrows + 1 + total) * sizeof(int) +
+                   (size_t)n * (3 * sizeof(int32_t) + 2 * sizeof(ImageLayout)));
+  }
+  if (first == NULL) {
+    for (int l = 0; l < n; l++) {
+      const ImageLayer* L = &layers[l];
+      int32_t A1, band1, Am1;
+      compositeWeights(L, &A1, &band1, &Am1);
+      materialize(L->img);
+      ImageLayout wasImg = untile(L->img);
+      ImageLayout wasMask = IMAGE_RASTER;
+      if (L->mask != NULL) {
+        materialize(L->mask);
+        wasMask = untile(L->mask);
+      }
+      compositeRect(img, L, A1, band1, Am1, L->x, L->y,
+                    L->x + L->img->width, L->y + L->img->height);
+      if (L->mask != NULL) retile(L->mask, wasMask);
+      retile(L->img, wasImg);
+    }
+    retile(img, was);
+    return;
+  }
+  int* list = first + nrows + 1;
+  int32_t* A = (int32_t*)(list + total);
+  int32_t* band = A + n;
+  int32_t* Am = band + n;
+  ImageLayout* wasImg = (ImageLayout*)(Am + n);
+  ImageLayout* wasMask = wasImg + n;
+
+  // Counting sort of layers by tile row, as in ImagePasteMany (stable:
+  // layers keep their order in each row, so blends apply in order).
+  memset(first, 0, (nrows + 1) * sizeof(int));
+  for (int l = 0; l < n; l++) {
+    const ImageLayer* L = &layers[l];
+    if (L->img->width == 0 || L->img->height == 0) continue;
+    for (int r = L->y / COMP_TILEH; r <= (L->y + L->img->height - 1) / COMP_TILEH; r++) {
+      first[r + 1]++;
+    }
+  }
+  for (int r = 0; r < nrows; r++) first[r + 1] += first[r];
+  for (int l = 0; l < n; l++) {
+    const ImageLayer* L = &layers[l];
+    if (L->img->width == 0 || L->img->height == 0) continue;
+    for (int r = L->y / COMP_TILEH; r <= (L->y + L->img->height - 1) / COMP_TILEH; r++) {
+      list[first[r]++] = l;
+    }
+  }
+  for (int r = nrows; r > 0; r--) first[r] = first[r - 1];
+  first[0] = 0;
+
+  // Layouts to restore, in reverse order (an image may appear repeatedly)
+  for (int l = 0; l < n; l++) {
+    const ImageLayer* L = &layers[l];
+    compositeWeights(L, &A[l], &band[l], &Am[l]);
+    materialize(L->img);
+    wasImg[l] = untile(L->img);
+    wasMask[l] = IMAGE_RASTER;
+    if (L->mask != NULL) {
+      materialize(L->mask);
+      wasMask[l] = untile(L->mask);
+    }
+  }
+
+  for (int r = 0; r < nrows; r++) {
+    int ty = r * COMP_TILEH;
+    int ty1 = ty + COMP_TILEH < img->height ? ty + COMP_TILEH : img->height;
+    for (int tx = 0; tx < img->width; tx += COMP_TILEW) {
+      int tx1 = tx + COMP_TILEW < img->width ? tx + COMP_TILEW : img->width;
+      for (int i = first[r]; i < first[r + 1]; i++) {
+        int l = list[i];
+        const ImageLayer* L = &layers[l];
+        // Intersection of the layer with this tile
+        int x0 = L->x > tx ? L->x : tx;
+        int x1 = L->x + L->img->width < tx1 ? L->x + L->img->width : tx1;
+        if (x0 >= x1) continue;
+        int y0 = L->y > ty ? L->y : ty;
+        int y1 = L->y + L->img->height < ty1 ? L->y + L->img->height : ty1;
+        compositeRect(img, L, A[l], band[l], Am[l], x0, y0, x1, y1);
+      }
     }
+  }
+  for (int l = n - 1; l >= 0; l--) {
+    if (layers[l].mask != NULL) retile(layers[l].mask, wasMask[l]);
+    retile(layers[l].img, wasImg[l]);
+  }
+  retile(img, was);
+  free(first);
 }
 
 /// Compare an image to a subimage of a larger image.
@@ -597,20 +2090,20 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
   assert (ImageValidPos(img1, x, y));
-  // Check if img2 matches the subimage of img1 at position (x, y)
-    for (int i = 0; i < img2->height; ++i) {
-        for (int j = 0; j < img2->width; ++j) {
-            // Calculate linear indices for both images
-            int img1Index = (y + i) * img1->width + (x + j);
-            int img2Index = i * img2->width + j;
-            // If pixel values don't match, return 0
-            if (img1->pixel[img1Index] != img2->pixel[img2Index]) {
-                return 0;
-            }
-        }
-    }
-    // If pixels match, return 1
-    return 1;
+  materialize(img1);
+  materialize(img2);
+  ImageLayout was1 = untile(img1);
+  ImageLayout was2 = untile(img2);
+  // Check if img2 matches the subimage of img1 at position (x, y), row by row
+  int match = 1;
+  for (int i = 0; match && i < img2->height; ++i) {
+    const uint8* r1 = img1->pixel + (size_t)(y + i) * img1->width + x;
+    const uint8* r2 = img2->pixel + (size_t)i * img2->width;
+    match = memcmp(r1, r2, img2->width) == 0;
+  }
+  retile(img2, was2);
+  retile(img1, was1);
+  return match;
 }
 
 /// Locate a subimage inside another image.
@@ -620,17 +2113,137 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) { ///
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
   assert (img1 != NULL);
   assert (img2 != NULL);
+  // Untile once here, rather than in every ImageMatchSubImage call
+  materialize(img1);
+  materialize(img2);
+  ImageLayout was1 = untile(img1);
+  ImageLayout was2 = untile(img2);
+  int found = 0;
   // Ensuring that the search area doesn't extend beyond the height of img2
-  for (int i = 0; i <= img1->height - img2->height; ++i) {
+  for (int i = 0; !found && i <= img1->height - img2->height; ++i) {
         for (int j = 0; j <= img1->width - img2->width; ++j) {
             // Check if img2 matches the subimage of img1 at position (j, i)
             if (ImageMatchSubImage(img1, j, i, img2)) {
                 *px = j;
                 *py = i;
-                return 1;
+                found = 1;
+                break;
             }
         }
   }
+  retile(img2, was2);
+  retile(img1, was1);
+  return found;
+}
+
+/// Find the first pixel, in raster order, where two images differ.
+/// If one is found, returns 1 and its position is set in (*px, *py)
+/// (unless they are NULL).
+/// If all pixels are equal, returns 0 and (*px, *py) are left untouched.
+/// The search stops at the first difference.
+/// Requires: img1 and img2 have the same size.
+int ImageFindDiff(Image img1, Image img2, int* px, int* py) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (img1->width == img2->width && img1->height == img2->height);
+  materialize(img1);
+  materialize(img2);
+  ImageLayout was1 = untile(img1);
+  ImageLayout was2 = untile(img2);
+  size_t n = (size_t)img1->width * img1->height;
+  size_t i = K->firstDiff(img1->pixel, img2->pixel, n);
+  PIXMEM += 2ul * (i < n ? i + 1 : n);  // pixels read up to the difference
+  retile(img2, was2);
+  retile(img1, was1);
+  if (i == n) return 0;
+  if (px != NULL) *px = (int)(i % img1->width);
+  if (py != NULL) *py = (int)(i / img1->width);
+  return 1;
+}
+
+/// Check whether two images are equal: same size, same maxval and same
+/// pixels (so ImageSave would write identical files).
+/// The comparison stops at the first difference.
+int ImageEquals(Image img1, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  return img1->width == img2->width && img1->height == img2->height &&
+         img1->maxval == img2->maxval && !ImageFindDiff(img1, img2, NULL, NULL);
+}
+
+/// Absolute difference of two images.
+/// Pixel (x,y) of the result is |img1(x,y) - img2(x,y)|, and its maxval is
+/// the larger of theirs.  The result has the layout of img1.
+/// Requires: img1 and img2 have the same size.
+/// Ensures: img1 and img2 are not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageDiff(Image img1, Image img2) { ///
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (img1->width == img2->width && img1->height == img2->height);
+  int w = img1->width;
+  int h = img1->height;
+  Image diff = ImageCreate(w, h, img1->maxval > img2->maxval ? img1->maxval : img2->maxval);
+  if (diff == NULL) return NULL;
+  materialize(img1);
+  materialize(img2);
+  ImageLayout was1 = untile(img1);
+  ImageLayout was2 = untile(img2);
+  K->absDiff(diff->pixel, img1->pixel, img2->pixel, (size_t)w * h);
+  PIXMEM += 3ul * w * h;  // read two, write one
+  retile(img2, was2);
+  retile(img1, was1);
+  if (was1 == IMAGE_TILED && !ImageSetLayout(diff, IMAGE_TILED)) {
+    errsave = errno;
+    ImageDestroy(&diff);
+    errno = errsave;
+  }
+  return diff;
+}
+
+// Sum of squared differences and maximum absolute difference of two images
+// of the same size.
+static uint64_t diffStats(Image img1, Image img2, uint8* maxabs) {
+  assert (img1 != NULL);
+  assert (img2 != NULL);
+  assert (img1->width == img2->width && img1->height == img2->height);
+  materialize(img1);
+  materialize(img2);
+  ImageLayout was1 = untile(img1);
+  ImageLayout was2 = untile(img2);
+  size_t n = (size_t)img1->width * img1->height;
+  uint64_t sse = 0;
+  *maxabs = 0;
+  K->diffStats(img1->pixel, img2->pixel, n, &sse, maxabs);
+  PIXMEM += 2ul * n;  // read both
+  retile(img2, was2);
+  retile(img1, was1);
+  return sse;
+}
+
+/// Maximum absolute difference between pixels of two images (0 if they
+/// have the same pixels).
+/// Requires: img1 and img2 have the same size.
+int ImageMaxAbsDiff(Image img1, Image img2) { ///
+  uint8 maxabs;
+  diffStats(img1, img2, &maxabs);
+  return maxabs;
+}
+
+/// Peak signal-to-noise ratio of img2 with respect to the reference img1,
+/// in dB: 10*log10(maxval^2/MSE), where maxval is that of img1 and MSE is
+/// the mean squared difference of their pixels.
+/// Returns INFINITY if the pixels are all equal (or the images are empty).
+/// Requires: img1 and img2 have the same size.
+double ImagePSNR(Image img1, Image img2) { ///
+  uint8 maxabs;
+  uint64_t sse = diffStats(img1, img2, &maxabs);
+  if (sse == 0) return INFINITY;
+  double mse = (double)sse / ((double)img1->width * img1->height);
+  return 10.0 * log10((double)img1->maxval * img1->maxval / mse);
 }
 
 
@@ -638,47 +2251,1503 @@ int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) { ///
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
-/// [x-dx, x+dx]x[y-dy, y+dy].
+/// [x-dx, x+dx]x[y-dy, y+dy] that are inside the image, truncated to an
+/// integer level.
 /// The image is changed in-place.
-void ImageBlur(Image img, int dx, int dy) { ///
-  assert(img != NULL);
-
-    // Create a temporary image to store the blurred result
-    Image blurredImg = ImageCreate(img->width, img->height, img->maxval);
-
-    // Iterate over each pixel in the original image
-    for (int y = 0; y < img->height; ++y) {
-        for (int x = 0; x < img->width; ++x) {
-            // Compute the mean of the pixels in the neighborhood
-            double sum = 0.0;
-            int count = 0;
-
-            for (int i = -dy; i <= dy; ++i) {
-                for (int j = -dx; j <= dx; ++j) {
-                    int nx = x + j;
-                    int ny = y + i;
-
-                    // Check if the neighborhood pixel is within bounds
-                    if (nx >= 0 && nx < img->width && ny >= 0 && ny < img->height) {
-                        // Calculate the linear index directly
-                        int index = ny * img->width + nx;
-                        sum += img->pixel[index];
-                        count++;
-                    }
-                }
-            }
+/// Requires: dx >= 0, dy >= 0.
+/// On success, returns nonzero.
+/// On failure (no memory for the running column sums or the output
+/// raster), returns 0 with the image unchanged, and errno/errCause are set
+/// accordingly.
+int ImageBlur(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  return ImageBlurRect(img, 0, 0, img->width, img->height, dx, dy);
+}
+
+// Add (sign = +1) or subtract (sign = -1) pixels [x0, x1) of row y of img
+// to the column sums acc[0..x1-x0).
+static void blurAddRow(uint32_t* acc, Image img, int x0, int x1, int y, int sign) {
+  for (int j = x0; j < x1; ) {
+    int n;
+    const uint8* p = rowSpan(img, j, y, &n);
+    n = n < x1 - j ? n : x1 - j;
+    K->accRow(acc + (j - x0), p, n, sign);
+    j += n;
+  }
+}
+
+/// Blur the rectangle (x,y,w,h) of img, as ImageBlur.
+/// Only pixels inside the rectangle change, but their windows include
+/// pixels outside it (up to dx columns and dy rows around it).
+/// Requires: the rectangle must be inside img, dx >= 0, dy >= 0.
+/// Success and failure are treated as in ImageBlur.
+int ImageBlurRect(Image img, int x, int y, int w, int h, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (ImageValidRect(img, x, y, w, h));
+  assert (dx >= 0 && dy >= 0);
+  unshare(img);
+  if (w == 0 || h == 0) return 1;
+  // Columns of the rectangle plus its horizontal halo
+  int cx0 = x - dx > 0 ? x - dx : 0;
+  int cx1 = x + w + dx < img->width ? x + w + dx : img->width;
+  uint32_t* acc = NULL;   // column sums over the current window rows
+  uint8* out = NULL;      // the blurred rectangle
+  int success =
+  check( (acc = calloc((size_t)(cx1 - cx0), sizeof(uint32_t))) != NULL, "Allocating work buffer failed" ) &&
+  check( (out = malloc((size_t)w * h)) != NULL, "Allocating pixels failed" );
+  if (!success) {
+    errsave = errno;
+    free(acc);
+    errno = errsave;
+    return 0;
+  }
+  // Window rows [ya, yb) slide down with the output row; sums are updated
+  // by adding the rows entering and subtracting the rows leaving.
+  // All output is buffered, so the halo is read before anything changes.
+  int ya = y - dy > 0 ? y - dy : 0;
+  int yb = ya;
+  unsigned long rowsRead = 0;
+  for (int i = 0; i < h; i++) {
+    int r = y + i;
+    int r0 = r - dy > 0 ? r - dy : 0;
+    int r1 = r + dy + 1 < img->height ? r + dy + 1 : img->height;
+    for (; yb < r1; yb++, rowsRead++) blurAddRow(acc, img, cx0, cx1, yb, +1);
+    for (; ya < r0; ya++, rowsRead++) blurAddRow(acc, img, cx0, cx1, ya, -1);
+    uint32_t rows = (uint32_t)(r1 - r0);
+    // Slide the window columns [c0, c1) right along the output row
+    int c0 = x - dx > 0 ? x - dx : 0;
+    int c1 = c0;
+    uint64_t sum = 0;
+    uint8* o = out + (size_t)i * w;
+    for (int j = 0; j < w; j++) {
+      int c = x + j;
+      int e0 = c - dx > 0 ? c - dx : 0;
+      int e1 = c + dx + 1 < img->width ? c + dx + 1 : img->width;
+      for (; c1 < e1; c1++) sum += acc[c1 - cx0];
+      for (; c0 < e0; c0++) sum -= acc[c0 - cx0];
+      o[j] = (uint8)(sum / ((uint64_t)rows * (uint32_t)(e1 - e0)));
+    }
+  }
+  // Store the rectangle
+  for (int i = 0; i < h; i++) {
+    for (int j = 0; j < w; ) {
+      int n;
+      uint8* p = rowSpan(img, x + j, y + i, &n);
+      n = n < w - j ? n : w - j;
+      memcpy(p, out + (size_t)i * w + j, n);
+      j += n;
+    }
+  }
+  PIXMEM += rowsRead * (unsigned long)(cx1 - cx0) + (unsigned long)w * h;
+  free(acc);
+  free(out);
+  return 1;
+}
+
+// Median filter state, after Perreault & Hebert, "Median Filtering in
+// Constant Time" (2007).
+// Each image column x keeps a histogram of the pixels of that column in the
+// current window rows; the window histogram is the sum of 2dx+1 column
+// histograms and slides right by adding one column and removing another.
+// Moving down a row updates each column histogram by one add and one remove.
+// Histograms are two-level: 16 coarse bins (level>>4) over 256 fine bins.
+// Sliding the window right updates only its 16 coarse bins.  The fine bins
+// of the window are updated lazily: each coarse bin remembers the window
+// position its 16 fine bins were last brought up to date for, and only the
+// coarse bin the median search lands in is updated, usually by a few steps.
+typedef struct {
+  uint32_t coarse[16];
+  uint32_t fine[256];
+} MedianHist;
+
+// The window histogram: fine bins of coarse bin c are valid for the
+// window centered at column last[c].
+typedef struct {
+  uint32_t coarse[16];
+  uint32_t fine[256];
+  int last[16];
+} MedianWindow;
+
+static inline void medianCoarseAdd(MedianWindow* restrict k, const MedianHist* restrict c) {
+  for (int i = 0; i < 16; i++) k->coarse[i] += c->coarse[i];
+}
+
+static inline void medianCoarseSub(MedianWindow* restrict k, const MedianHist* restrict c) {
+  for (int i = 0; i < 16; i++) k->coarse[i] -= c->coarse[i];
+}
+
+// Bring the fine bins of coarse bin c of window k up to date for the window
+// centered at column x (columns [x-dx, x+dx] of col[0..w-1]): step by step
+// from last[c], or from scratch if the window moved by a whole width.
+static void medianFineUpdate(MedianWindow* k, const MedianHist* col, int c, int x, int dx, int w) {
+  uint32_t* f = k->fine + 16 * c;
+  if (x - k->last[c] > 2 * dx + 1) {
+    memset(f, 0, 16 * sizeof(uint32_t));
+    int x1 = x + dx < w ? x + dx : w - 1;
+    for (int i = x - dx > 0 ? x - dx : 0; i <= x1; i++) {
+      const uint32_t* g = col[i].fine + 16 * c;
+      for (int j = 0; j < 16; j++) f[j] += g[j];
+    }
+  } else {
+    for (int i = k->last[c] + 1; i <= x; i++) {
+      if (i + dx < w) {
+        const uint32_t* g = col[i + dx].fine + 16 * c;
+        for (int j = 0; j < 16; j++) f[j] += g[j];
+      }
+      if (i - dx - 1 >= 0) {
+        const uint32_t* g = col[i - dx - 1].fine + 16 * c;
+        for (int j = 0; j < 16; j++) f[j] -= g[j];
+      }
+    }
+  }
+  k->last[c] = x;
+}
+
+// The level of rank target (1-based) in window k, centered at column x.
+static inline uint8 medianRank(MedianWindow* k, const MedianHist* col, int x, int dx, int w,
+                               uint32_t target) {
+  uint32_t cum = 0;
+  int c = 0;
+  while (cum + k->coarse[c] < target) cum += k->coarse[c++];
+  if (k->last[c] != x) medianFineUpdate(k, col, c, x, dx, w);
+  int v = c << 4;
+  while (cum + k->fine[v] < target) cum += k->fine[v++];
+  return (uint8)v;
+}
+
+/// Apply a (2dx+1)x(2dy+1) median filter.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that are inside the image (near the borders
+/// the window is truncated, as in ImageBlur).  For an even number of pixels
+/// the lower median is used.
+/// Cost per pixel is independent of dx and dy.
+/// Requires: dx >= 0, dy >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (no memory for the work buffers), returns 0, the image is
+/// unchanged and errno/errCause are set accordingly.
+int ImageMedian(Image img, int dx, int dy) { ///
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  unshare(img);
+  ImageLayout was = untile(img);
+  int w = img->width;
+  int h = img->height;
+  MedianHist* col = NULL;
+  uint8* out = NULL;
+  int success =
+  check( (col = calloc((size_t)w, sizeof(MedianHist))) != NULL, "Allocating histograms failed" ) &&
+  check( (out = malloc((size_t)w * h)) != NULL, "Allocating pixels failed" );
+  if (!success) {
+    errsave = errno;
+    free(col);
+    errno = errsave;
+    retile(img, was);
+    return 0;
+  }
+  const uint8* in = img->pixel;
+
+  // Prime the column histograms with rows [0, dy-1]; the loop adds row y+dy.
+  for (int y = 0; y < dy && y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      uint8 v = in[(size_t)y * w + x];
+      col[x].coarse[v >> 4]++;
+      col[x].fine[v]++;
+    }
+  }
+  MedianWindow k;
+  for (int y = 0; y < h; y++) {
+    // Slide every column window down to rows [y-dy, y+dy]
+    if (y - dy - 1 >= 0) {
+      const uint8* row = in + (size_t)(y - dy - 1) * w;
+      for (int x = 0; x < w; x++) {
+        col[x].coarse[row[x] >> 4]--;
+        col[x].fine[row[x]]--;
+      }
+    }
+    if (y + dy < h) {
+      const uint8* row = in + (size_t)(y + dy) * w;
+      for (int x = 0; x < w; x++) {
+        col[x].coarse[row[x] >> 4]++;
+        col[x].fine[row[x]]++;
+      }
+    }
+    int rows = (y + dy < h ? y + dy : h - 1) - (y - dy > 0 ? y - dy : 0) + 1;
+    // Window coarse bins for x = 0: columns [0, dx]; no fine bins valid
+    memset(k.coarse, 0, sizeof(k.coarse));
+    for (int c = 0; c < 16; c++) k.last[c] = -2 * dx - 2;
+    for (int x = 0; x <= dx && x < w; x++) {
+      medianCoarseAdd(&k, &col[x]);
+    }
+    uint8* orow = out + (size_t)y * w;
+    for (int x = 0; x < w; x++) {
+      if (x > 0) {
+        if (x + dx < w) medianCoarseAdd(&k, &col[x + dx]);
+        if (x - dx - 1 >= 0) medianCoarseSub(&k, &col[x - dx - 1]);
+      }
+      int cols = (x + dx < w ? x + dx : w - 1) - (x - dx > 0 ? x - dx : 0) + 1;
+      uint32_t count = (uint32_t)cols * rows;
+      orow[x] = medianRank(&k, col, x, dx, w, (count + 1) / 2);
+    }
+  }
+  PIXMEM += 3ul * w * h;  // each pixel enters and leaves a column once, plus the store
+
+  free(img->pixel);
+  img->pixel = out;
+  free(col);
+  retile(img, was);
+  return 1;
+}
+
+// Morphology with the van Herk / Gil-Werman algorithm.
+//
+// A running min over windows of k = 2r+1 samples: split the (padded) line
+// into blocks of k samples and compute, within each block, prefix minima G
+// (left to right) and suffix minima H (right to left).  A window starting
+// at q spans at most two blocks, so its minimum is min(H[q], G[q+2r]):
+// about three comparisons per sample, whatever r is.
+// The line is padded with r samples of 255 (neutral for min) at each end,
+// which gives the same truncated windows as ImageBlur.
+//
+// Dilation is erosion in the complemented domain: max(a,b) = ~min(~a,~b).
+// So one kernel serves both, XORing samples with inflip on load and
+// outflip on store (0 or 255).
+//
+// The pass runs down the columns, on whole rows at a time, so each step is
+// a vector min over a row (the minRow and minPair kernels).  Rows are
+// filtered by transposing the image, running the column pass, and
+// transposing back.
+
+// Column pass over rows of p (w x h), window 2r+1; H holds w*h bytes,
+// run holds w bytes.  Writes in place: output row y is stored only after
+// input row y+r has been read.
+// Padded row q is image row q-r; padding rows (all 255) are neutral for
+// min, so they are skipped rather than materialized.
+static void morphCols(uint8* p, int w, int h, int r, uint8 inflip, uint8 outflip,
+                      uint8* restrict H, uint8* restrict run) {
+  int k = 2 * r + 1;
+  long last = (long)h + 2 * r;  // padded rows that end a window
+  // Suffix minima, block by block from the last one holding a row < h;
+  // only H[0..h-1] is kept
+  for (long b = (h - 1) / k * (long)k; b >= 0; b -= k) {
+    memset(run, 255, w);
+    for (long q = b + k - 1; q >= b; q--) {
+      if (q >= r && q < (long)h + r) K->minRow(run, p + (size_t)(q - r) * w, inflip, w);
+      if (q < h) memcpy(H + (size_t)q * w, run, w);
+    }
+  }
+  // Prefix minima, block by block, combined with H into the output
+  for (long b = 0; b < last; b += k) {
+    long q1 = b + k < last ? b + k : last;
+    memset(run, 255, w);
+    for (long q = b; q < q1; q++) {
+      if (q >= r && q < (long)h + r) K->minRow(run, p + (size_t)(q - r) * w, inflip, w);
+      long o = q - 2 * r;  // output row whose window ends at q
+      if (o >= 0) K->minPair(p + (size_t)o * w, H + (size_t)o * w, run, outflip, w);
+    }
+  }
+}
+
+// Transpose the raster s (w x h) into d (h x w), in square blocks (as
+// orientCopy does for transposing views).
+static void transposeRaster(uint8* restrict d, const uint8* restrict s, int w, int h) {
+  for (int x0 = 0; x0 < w; x0 += ORIENT_BLOCK) {
+    int x1 = x0 + ORIENT_BLOCK < w ? x0 + ORIENT_BLOCK : w;
+    for (int y0 = 0; y0 < h; y0 += ORIENT_BLOCK) {
+      int n = y0 + ORIENT_BLOCK < h ? ORIENT_BLOCK : h - y0;
+      for (int x = x0; x < x1; x++) {
+        K->gatherRow(d + (size_t)x * h + y0, s + (size_t)y0 * w + x, w, n);
+      }
+    }
+  }
+}
+
+// Erosion (flip = 0) or dilation (flip = 255) of img by a rectangle.
+static int morph(Image img, int dx, int dy, uint8 flip) {
+  assert (img != NULL);
+  assert (dx >= 0 && dy >= 0);
+  unshare(img);
+  ImageLayout was = untile(img);
+  int w = img->width;
+  int h = img->height;
+  size_t n = (size_t)w * h;
+  // H, then the transposed image if rows are filtered, then run
+  uint8* H = NULL;
+  if (!check( (H = malloc(n + (dx > 0 ? n : 0) + (w > h ? w : h) + 1)) != NULL,
+              "Allocating work buffer failed" )) {
+    retile(img, was);
+    return 0;
+  }
+  uint8* T = H + n;
+  uint8* run = T + (dx > 0 ? n : 0);
+  if (dy > 0) morphCols(img->pixel, w, h, dy, flip, dx > 0 ? 0 : flip, H, run);
+  if (dx > 0) {
+    transposeRaster(T, img->pixel, w, h);
+    morphCols(T, h, w, dx, dy > 0 ? 0 : flip, flip, H, run);
+    transposeRaster(img->pixel, T, h, w);
+  }
+  // 2 reads and 2 writes per pass, and 2 per transpose
+  PIXMEM += ((dy > 0) * 4ul + (dx > 0) * 8ul) * n;
+  free(H);
+  retile(img, was);
+  return 1;
+}
+
+/// Grayscale erosion with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the minimum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that are inside the image.
+/// Cost per pixel is independent of dx and dy.
+/// Requires: dx >= 0, dy >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (no memory for the work buffer), returns 0 and
+/// errno/errCause are set accordingly.
+int ImageErode(Image img, int dx, int dy) { ///
+  return morph(img, dx, dy, 0);
+}
+
+/// Grayscale dilation with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the maximum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that are inside the image.
+/// Cost per pixel is independent of dx and dy.
+/// Requires: dx >= 0, dy >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (no memory for the work buffer), returns 0 and
+/// errno/errCause are set accordingly.
+int ImageDilate(Image img, int dx, int dy) { ///
+  return morph(img, dx, dy, 255);
+}
+
+/// Morphological opening: erosion followed by dilation, same rectangle.
+/// Removes bright details smaller than the rectangle.
+/// Cost per pixel is independent of dx and dy.
+/// Requires: dx >= 0, dy >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (no memory for the work buffer), returns 0 and
+/// errno/errCause are set accordingly.
+int ImageOpen(Image img, int dx, int dy) { ///
+  return morph(img, dx, dy, 0) && morph(img, dx, dy, 255);
+}
+
+/// Morphological closing: dilation followed by erosion, same rectangle.
+/// Fills dark details smaller than the rectangle.
+/// Cost per pixel is independent of dx and dy.
+/// Requires: dx >= 0, dy >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (no memory for the work buffer), returns 0 and
+/// errno/errCause are set accordingly.
+int ImageClose(Image img, int dx, int dy) { ///
+  return morph(img, dx, dy, 255) && morph(img, dx, dy, 0);
+}
 
-            // Compute the mean and update the blurred image
-            int index = y * img->width + x;
-            blurredImg->pixel[index] = (uint8_t)(sum / count);
+// Convolution engine.
+//
+// Source rows are kept in a ring of kh rows, each padded with kw/2
+// replicated border pixels on both sides, so the inner loops have no
+// bounds tests.  An output row is accumulated in int32 as a sum of
+// kw*kh shifted source rows scaled by one coefficient each; those loops run
+// across x and vectorize.
+// convRow is instantiated with constant kw,kh for the common 3x3 and 5x5
+// kernels so the compiler can fully unroll the coefficient loops.
+// If the kernel factors as an outer product col*row of integer vectors, the
+// separable path does a horizontal pass (kw terms) into a ring of int32 rows
+// and a vertical pass (kh terms) instead: kw+kh instead of kw*kh per pixel.
+
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+// Copy row src (w pixels) to dst with r replicated pixels on each side.
+static void padRow(uint8* dst, const uint8* src, int w, int r) {
+  memset(dst, src[0], r);
+  memcpy(dst + r, src, w);
+  memset(dst + r + w, src[w - 1], r);
+}
+
+// Ring slot of (unclamped) source row yy, in a ring of n rows.
+static inline int ringSlot(int yy, int n) {
+  return ((yy % n) + n) % n;
+}
+
+static inline int clampInt(int v, int lo, int hi) {
+  return v < lo ? lo : (v > hi ? hi : v);
+}
+
+// acc[x] = sum over i,j of kernel[i*kw+j] * rows[i][x+j], for x in [0, w).
+static ALWAYS_INLINE void convRow(int32_t* restrict acc, uint8* const* rows,
+                                  const int* kernel, int kw, int kh, int w) {
+  for (int x = 0; x < w; x++) acc[x] = 0;
+  for (int i = 0; i < kh; i++) {
+    const uint8* restrict src = rows[i];
+    for (int j = 0; j < kw; j++) {
+      int32_t c = kernel[i * kw + j];
+      if (c == 0) continue;
+      for (int x = 0; x < w; x++) acc[x] += c * (int32_t)src[x + j];
+    }
+  }
+}
+
+static void convRow3x3(int32_t* acc, uint8* const* rows, const int* kernel, int w) {
+  convRow(acc, rows, kernel, 3, 3, w);
+}
+
+static void convRow5x5(int32_t* acc, uint8* const* rows, const int* kernel, int w) {
+  convRow(acc, rows, kernel, 5, 5, w);
+}
+
+static void convRowAny(int32_t* acc, uint8* const* rows, const int* kernel, int kw, int kh, int w) {
+  convRow(acc, rows, kernel, kw, kh, w);
+}
+
+// Scale an accumulator row into dst: round(acc/divisor) + bias, saturated.
+// A power-of-two divisor becomes a shift (vectorizable); otherwise this
+// uses integer division.
+static void convStore(uint8* restrict dst, const int32_t* restrict acc, int w,
+                      int divisor, int bias, int maxval) {
+  int shift = 0;
+  while ((1 << shift) < divisor) shift++;
+  if ((1 << shift) == divisor) {
+    int32_t half = shift > 0 ? 1 << (shift - 1) : 0;
+    for (int x = 0; x < w; x++) {
+      int32_t v = ((acc[x] + half) >> shift) + bias;
+      dst[x] = (uint8)(v < 0 ? 0 : (v > maxval ? maxval : v));
+    }
+  } else {
+    for (int x = 0; x < w; x++) {
+      // floor((2*acc + divisor) / (2*divisor)), i.e. round half up
+      int64_t num = 2 * (int64_t)acc[x] + divisor;
+      int64_t den = 2 * (int64_t)divisor;
+      int64_t q = num >= 0 ? num / den : -((-num + den - 1) / den);
+      int64_t v = q + bias;
+      dst[x] = (uint8)(v < 0 ? 0 : (v > maxval ? maxval : v));
+    }
+  }
+}
+
+// Find integer vectors col[kh], row[kw] with kernel = col * row^T.
+// Returns 1 if the kernel is separable that way, 0 otherwise.
+static int convFactor(const int* kernel, int kw, int kh, int* col, int* row) {
+  // Reference row: the first nonzero one
+  int i0 = 0;
+  while (i0 < kh) {
+    int j = 0;
+    while (j < kw && kernel[i0 * kw + j] == 0) j++;
+    if (j < kw) break;
+    i0++;
+  }
+  if (i0 == kh) return 0;  // all zeros: not worth a special path
+  // row = reference row divided by the gcd of its entries
+  int g = 0;
+  for (int j = 0; j < kw; j++) {
+    int a = abs(kernel[i0 * kw + j]);
+    while (a != 0) { int t = g % a; g = a; a = t; }
+  }
+  int jn = -1;  // a column where row is nonzero
+  for (int j = 0; j < kw; j++) {
+    row[j] = kernel[i0 * kw + j] / g;
+    if (row[j] != 0 && jn < 0) jn = j;
+  }
+  // Every row of the kernel must be an integer multiple of row
+  for (int i = 0; i < kh; i++) {
+    const int* k = kernel + i * kw;
+    if (k[jn] % row[jn] != 0) return 0;
+    col[i] = k[jn] / row[jn];
+    for (int j = 0; j < kw; j++) {
+      if (k[j] != col[i] * row[j]) return 0;
+    }
+  }
+  return 1;
+}
+
+/// Convolve the image with an integer kernel.
+///   kernel: kh rows of kw integer coefficients (row-major), centered on
+///     the pixel, so kw and kh must be odd.
+/// Each pixel is substituted by
+///   round(sum(kernel[i][j] * p[y+i-kh/2][x+j-kw/2]) / divisor) + bias,
+/// saturated to [0, maxval], where positions outside the image take the
+/// value of the nearest border pixel.
+/// Accumulation is exact, in 32-bit integers.
+/// Requires: kw, kh odd and positive, divisor > 0,
+///   and sum(|kernel[i][j]|) * maxval must fit in an int32.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (no memory for the work buffers), returns 0 and
+/// errno/errCause are set accordingly.
+int ImageConvolve(Image img, const int* kernel, int kw, int kh, int divisor, int bias) { ///
+  assert (img != NULL);
+  assert (kernel != NULL);
+  assert (kw > 0 && kw % 2 == 1 && kh > 0 && kh % 2 == 1);
+  assert (divisor > 0);
+  unshare(img);
+  int w = img->width;
+  int h = img->height;
+  if (w == 0 || h == 0) return 1;
+  ImageLayout was = untile(img);
+  int rx = kw / 2;
+  int ry = kh / 2;
+  int pw = w + 2 * rx;
+  int col[kh], row[kw];
+  int separable = kw > 1 && kh > 1 && convFactor(kernel, kw, kh, col, row);
+
+  uint8* out = NULL;
+  uint8* ring = NULL;
+  int32_t* acc = NULL;
+  int32_t* hring = NULL;
+  int success =
+  check( (out = malloc((size_t)w * h)) != NULL, "Allocating pixels failed" ) &&
+  check( (ring = malloc((size_t)kh * pw)) != NULL, "Allocating work buffer failed" ) &&
+  check( (acc = malloc((size_t)w * sizeof(int32_t))) != NULL, "Allocating work buffer failed" ) &&
+  check( !separable || (hring = malloc((size_t)kh * w * sizeof(int32_t))) != NULL, "Allocating work buffer failed" );
+  if (!success) {
+    errsave = errno;
+    free(out); free(ring); free(acc);
+    errno = errsave;
+    retile(img, was);
+    return 0;
+  }
+
+  uint8* rows[kh];
+  for (int y = 0; y < h; y++) {
+    // Bring the new source rows into the ring (all of them on the first row)
+    for (int yy = (y == 0 ? -ry : y + ry); yy <= y + ry; yy++) {
+      int slot = ringSlot(yy, kh);
+      padRow(ring + (size_t)slot * pw, img->pixel + (size_t)clampInt(yy, 0, h - 1) * w, w, rx);
+      if (separable) {
+        // Horizontal pass of the new row
+        const uint8* src = ring + (size_t)slot * pw;
+        int32_t* restrict hr = hring + (size_t)slot * w;
+        for (int x = 0; x < w; x++) hr[x] = 0;
+        for (int j = 0; j < kw; j++) {
+          int32_t c = row[j];
+          if (c == 0) continue;
+          for (int x = 0; x < w; x++) hr[x] += c * (int32_t)src[x + j];
+        }
+      }
+    }
+    if (separable) {
+      // Vertical pass
+      for (int x = 0; x < w; x++) acc[x] = 0;
+      for (int i = 0; i < kh; i++) {
+        int32_t c = col[i];
+        if (c == 0) continue;
+        const int32_t* restrict hr = hring + (size_t)ringSlot(y - ry + i, kh) * w;
+        for (int x = 0; x < w; x++) acc[x] += c * hr[x];
+      }
+    } else {
+      for (int i = 0; i < kh; i++) {
+        rows[i] = ring + (size_t)ringSlot(y - ry + i, kh) * pw;
+      }
+      if (kw == 3 && kh == 3) convRow3x3(acc, rows, kernel, w);
+      else if (kw == 5 && kh == 5) convRow5x5(acc, rows, kernel, w);
+      else convRowAny(acc, rows, kernel, kw, kh, w);
+    }
+    convStore(out + (size_t)y * w, acc, w, divisor, bias, img->maxval);
+  }
+  PIXMEM += 2ul * w * h;  // each source row is read into the ring once, plus the store
+
+  free(img->pixel);
+  img->pixel = out;
+  free(ring);
+  free(acc);
+  free(hring);
+  retile(img, was);
+  return 1;
+}
+
+/// Sobel edge magnitude.
+/// Each pixel is substituted by |Gx| + |Gy|, saturated to maxval, where
+/// Gx and Gy are the horizontal and vertical 3x3 Sobel derivatives
+/// (with border pixels replicated, as in ImageConvolve).
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (no memory for the work buffers), returns 0 and
+/// errno/errCause are set accordingly.
+int ImageSobel(Image img) { ///
+  assert (img != NULL);
+  unshare(img);
+  int w = img->width;
+  int h = img->height;
+  if (w == 0 || h == 0) return 1;
+  ImageLayout was = untile(img);
+  int pw = w + 2;
+  uint8* out = NULL;
+  uint8* ring = NULL;
+  int success =
+  check( (out = malloc((size_t)w * h)) != NULL, "Allocating pixels failed" ) &&
+  check( (ring = malloc((size_t)3 * pw)) != NULL, "Allocating work buffer failed" );
+  if (!success) {
+    errsave = errno;
+    free(out);
+    errno = errsave;
+    retile(img, was);
+    return 0;
+  }
+  int maxval = img->maxval;
+  for (int y = 0; y < h; y++) {
+    for (int yy = (y == 0 ? -1 : y + 1); yy <= y + 1; yy++) {
+      padRow(ring + (size_t)ringSlot(yy, 3) * pw,
+             img->pixel + (size_t)clampInt(yy, 0, h - 1) * w, w, 1);
+    }
+    const uint8* restrict a = ring + (size_t)ringSlot(y - 1, 3) * pw;
+    const uint8* restrict b = ring + (size_t)ringSlot(y, 3) * pw;
+    const uint8* restrict c = ring + (size_t)ringSlot(y + 1, 3) * pw;
+    uint8* restrict d = out + (size_t)y * w;
+    for (int x = 0; x < w; x++) {
+      int32_t gx = (a[x+2] - a[x]) + 2 * (b[x+2] - b[x]) + (c[x+2] - c[x]);
+      int32_t gy = (c[x] + 2 * c[x+1] + c[x+2]) - (a[x] + 2 * a[x+1] + a[x+2]);
+      int32_t v = (gx < 0 ? -gx : gx) + (gy < 0 ? -gy : gy);
+      d[x] = (uint8)(v > maxval ? maxval : v);
+    }
+  }
+  PIXMEM += 2ul * w * h;
+
+  free(img->pixel);
+  img->pixel = out;
+  free(ring);
+  retile(img, was);
+  return 1;
+}
+
+// Connected component labeling.
+//
+// Foreground pixels are grouped into runs (maximal horizontal segments).
+// The image is split into horizontal strips; in each strip (in parallel)
+// runs are extracted and every run is joined, with union-find over run
+// indices, to the overlapping runs of the previous row.  Then the strips'
+// boundary rows are joined in the calling thread, and a final pass resolves
+// each run's root to a compact label, accumulating component stats.
+// Union-find links the larger root index to the smaller one, so the root
+// of a component is its first run in raster order.
+
+// A run of foreground pixels [x0, x1) in row y
+typedef struct {
+  int x0, x1, y;
+} CCRun;
+
+typedef struct {
+  const Image img;
+  int conn;        // 4 or 8
+  int rowsPer;     // rows per strip
+  CCRun** runs;    // per strip: its runs
+  size_t* nruns;   // per strip: number of runs
+  size_t** parent; // per strip: union-find parents (strip-local indices)
+  int failed;      // set by a strip that could not allocate
+} CCJob;
+
+static size_t ccFind(size_t* parent, size_t i) {
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];  // path halving
+    i = parent[i];
+  }
+  return i;
+}
+
+static void ccUnion(size_t* parent, size_t a, size_t b) {
+  a = ccFind(parent, a);
+  b = ccFind(parent, b);
+  if (a < b) parent[b] = a;
+  else if (b < a) parent[a] = b;
+}
+
+// Join runs [a0,a1) of one row with runs [b0,b1) of the next row.
+// Runs overlap if they share a column (4-connectivity), or are at most
+// diagonally adjacent (8-connectivity: slack 1).
+static void ccJoinRows(const CCRun* runs, size_t* parent, size_t a0, size_t a1,
+                       size_t b0, size_t b1, int slack) {
+  size_t i = a0, j = b0;
+  while (i < a1 && j < b1) {
+    if (runs[i].x0 < runs[j].x1 + slack && runs[j].x0 < runs[i].x1 + slack) {
+      ccUnion(parent, i, j);
+    }
+    // Advance the run that ends first
+    if (runs[i].x1 < runs[j].x1) i++;
+    else j++;
+  }
+}
+
+// Label strip s: extract its runs and join them within the strip.
+static void ccStrip(void* ctx, int s) {
+  CCJob* job = ctx;
+  Image img = job->img;
+  int w = img->width;
+  int y0 = s * job->rowsPer;
+  int y1 = y0 + job->rowsPer < img->height ? y0 + job->rowsPer : img->height;
+  size_t cap = 64, n = 0;
+  CCRun* runs = malloc(cap * sizeof(CCRun));
+  if (runs == NULL) { job->failed = 1; return; }
+  for (int y = y0; y < y1; y++) {
+    const uint8* p = img->pixel + (size_t)y * w;
+    int x = 0;
+    while (x < w) {
+      while (x < w && p[x] == 0) x++;
+      if (x == w) break;
+      int x0 = x;
+      while (x < w && p[x] != 0) x++;
+      if (n == cap) {
+        CCRun* r = realloc(runs, 2 * cap * sizeof(CCRun));
+        if (r == NULL) { free(runs); job->failed = 1; return; }
+        runs = r;
+        cap *= 2;
+      }
+      runs[n++] = (CCRun){ x0, x, y };
+    }
+  }
+  size_t* parent = malloc((n > 0 ? n : 1) * sizeof(size_t));
+  if (parent == NULL) { free(runs); job->failed = 1; return; }
+  for (size_t i = 0; i < n; i++) parent[i] = i;
+  // Join each row with the previous one
+  int slack = job->conn == 8 ? 1 : 0;
+  size_t a0 = 0;
+  while (a0 < n) {
+    size_t a1 = a0;
+    while (a1 < n && runs[a1].y == runs[a0].y) a1++;
+    if (a1 < n && runs[a1].y == runs[a0].y + 1) {
+      size_t b1 = a1;
+      while (b1 < n && runs[b1].y == runs[a1].y) b1++;
+      ccJoinRows(runs, parent, a0, a1, a1, b1, slack);
+    }
+    a0 = a1;
+  }
+  job->runs[s] = runs;
+  job->nruns[s] = n;
+  job->parent[s] = parent;
+}
+
+/// Label the connected components of nonzero pixels.
+///   connectivity: 4 or 8.
+///   labels: if not NULL, *labels is set to a new array of w*h labels in
+///     raster order: 0 for background, 1..n for the components.
+///   comps: if not NULL, *comps is set to a new array of n component stats,
+///     (*comps)[i] describing label i+1.
+/// Components are numbered in raster order of their first pixel.
+/// The work is split in horizontal strips labelled in parallel (see
+/// ImageSetThreads) and merged at strip boundaries.
+/// (The caller is responsible for freeing *labels and *comps with free()!)
+/// On success, returns the number of components n.
+/// On failure, returns -1 and errno/errCause are set accordingly.
+long ImageLabelComponents(Image img, int connectivity, uint32_t** labels, ImageComponent** comps) { ///
+  assert (img != NULL);
+  assert (connectivity == 4 || connectivity == 8);
+  materialize(img);
+  ImageLayout was = untile(img);
+  int w = img->width;
+  int h = img->height;
+  // Strips of at least 64 rows, at most 4 per thread for load balance
+  int nstrips = nThreads * 4;
+  if (nstrips > (h + 63) / 64) nstrips = (h + 63) / 64;
+  if (nstrips < 1) nstrips = 1;
+  int rowsPer = (h + nstrips - 1) / nstrips;
+  if (rowsPer < 1) rowsPer = 1;
+
+  CCJob job = { img, connectivity, rowsPer, NULL, NULL, NULL, 0 };
+  size_t* parent = NULL;
+  CCRun* runs = NULL;
+  size_t* first = NULL;   // index of each strip's first run in the global arrays
+  uint32_t* lab = NULL;
+  ImageComponent* cs = NULL;
+  long ncomp = -1;
+
+  int success =
+  check( (job.runs = calloc(nstrips, sizeof(CCRun*))) != NULL, "Allocating strips failed" ) &&
+  check( (job.nruns = calloc(nstrips, sizeof(size_t))) != NULL, "Allocating strips failed" ) &&
+  check( (job.parent = calloc(nstrips, sizeof(size_t*))) != NULL, "Allocating strips failed" ) &&
+  check( (first = malloc((nstrips + 1) * sizeof(size_t))) != NULL, "Allocating strips failed" );
+  if (success) {
+    parallelFor(nstrips, ccStrip, &job);
+    success = check( !job.failed, "Allocating runs failed" );
+  }
+  // Gather strips into global arrays, offsetting parent indices
+  size_t total = 0;
+  if (success) {
+    for (int s = 0; s < nstrips; s++) {
+      first[s] = total;
+      total += job.nruns[s];
+    }
+    first[nstrips] = total;
+    success =
+    check( (runs = malloc((total > 0 ? total : 1) * sizeof(CCRun))) != NULL, "Allocating runs failed" ) &&
+    check( (parent = malloc((total > 0 ? total : 1) * sizeof(size_t))) != NULL, "Allocating runs failed" );
+  }
+  if (success) {
+    for (int s = 0; s < nstrips; s++) {
+      for (size_t i = 0; i < job.nruns[s]; i++) {
+        runs[first[s] + i] = job.runs[s][i];
+        parent[first[s] + i] = first[s] + job.parent[s][i];
+      }
+    }
+    // Join the last row of each strip with the first row of the next
+    int slack = connectivity == 8 ? 1 : 0;
+    for (int s = 1; s < nstrips; s++) {
+      int yb = s * rowsPer;
+      size_t b0 = first[s], b1 = b0;
+      while (b1 < first[s + 1] && runs[b1].y == yb) b1++;
+      size_t a1 = first[s], a0 = a1;
+      while (a0 > first[s - 1] && runs[a0 - 1].y == yb - 1) a0--;
+      ccJoinRows(runs, parent, a0, a1, b0, b1, slack);
+    }
+    // Count components: runs that are their own root
+    ncomp = 0;
+    for (size_t i = 0; i < total; i++) ncomp += (ccFind(parent, i) == i);
+    success =
+    check( (cs = calloc(ncomp > 0 ? ncomp : 1, sizeof(ImageComponent))) != NULL, "Allocating components failed" ) &&
+    check( labels == NULL || (lab = calloc((size_t)w * h, sizeof(uint32_t))) != NULL, "Allocating labels failed" );
+  }
+  if (success) {
+    // Roots come first in raster order (a root is its component's smallest
+    // run index), so numbering roots as they are met gives raster-ordered
+    // labels, and every run's root is labelled before the run is visited.
+    uint32_t* rootLabel = (uint32_t*)malloc((total > 0 ? total : 1) * sizeof(uint32_t));
+    success = check( rootLabel != NULL, "Allocating labels failed" );
+    if (success) {
+      uint32_t next = 0;
+      for (size_t i = 0; i < total; i++) {
+        size_t r = ccFind(parent, i);
+        uint32_t l = (r == i) ? (rootLabel[i] = ++next) : rootLabel[r];
+        ImageComponent* c = &cs[l - 1];
+        const CCRun* u = &runs[i];
+        uint64_t len = (uint64_t)(u->x1 - u->x0);
+        if (r == i) {  // first run: initialize the bounding box
+          c->xmin = u->x0; c->xmax = u->x1 - 1;
+          c->ymin = c->ymax = u->y;
         }
+        c->area += len;
+        c->xmin = u->x0 < c->xmin ? u->x0 : c->xmin;
+        c->xmax = u->x1 - 1 > c->xmax ? u->x1 - 1 : c->xmax;
+        c->ymax = u->y > c->ymax ? u->y : c->ymax;
+        c->cx += (double)len * (u->x0 + u->x1 - 1) / 2.0;  // sum of x over the run
+        c->cy += (double)len * u->y;
+        if (lab != NULL) {
+          uint32_t* d = lab + (size_t)u->y * w;
+          for (int x = u->x0; x < u->x1; x++) d[x] = l;
+        }
+      }
+      for (long i = 0; i < ncomp; i++) {
+        cs[i].cx /= (double)cs[i].area;
+        cs[i].cy /= (double)cs[i].area;
+      }
+      free(rootLabel);
+    }
+    PIXMEM += (unsigned long)w * h;  // one read per pixel (plus label stores)
+  }
+
+  // Cleanup
+  errsave = errno;
+  for (int s = 0; job.runs != NULL && s < nstrips; s++) {
+    free(job.runs[s]);
+    free(job.parent[s]);
+  }
+  free(job.runs);
+  free(job.nruns);
+  free(job.parent);
+  free(first);
+  free(runs);
+  free(parent);
+  if (!success) {
+    free(lab);
+    free(cs);
+    errno = errsave;
+    retile(img, was);
+    return -1;
+  }
+  if (labels != NULL) *labels = lab;
+  if (comps != NULL) *comps = cs; else free(cs);
+  errno = errsave;
+  retile(img, was);
+  return ncomp;
+}
+
+
+/// Binary images
+
+/// A Bitmap is a binary image stored with 1 bit per pixel, packed in 64-bit
+/// words, so that logical operations, counting, pasting and matching work
+/// on 64 pixels per word operation.
+/// A set bit (1) is a white (foreground) pixel, a clear bit (0) is black.
+/// Success and failure of functions that allocate or do I/O are treated as
+/// for images: NULL or 0 is returned and errno/errCause are set.
+
+// Internal structure for bitmaps.
+// Row y is stored in words bits[y*stride .. y*stride+stride-1]; pixel x of
+// the row is bit (x % 64) of word (x / 64) (least significant bit first).
+// Bits past the width in the last word of a row are always 0.
+struct bitmap {
+  int width;
+  int height;
+  int stride;      // 64-bit words per row
+  uint64_t* bits;
+};
+
+// Pointer to the first word of row y
+#define BROW(b, y) ((b)->bits + (size_t)(y) * (b)->stride)
+// Mask of the valid bits in the last word of a row (when width % 64 != 0)
+#define LASTMASK(b) ((((uint64_t)1) << ((b)->width & 63)) - 1)
+
+static inline int popcount64(uint64_t v) {
+#ifdef __GNUC__
+  return __builtin_popcountll(v);
+#else
+  v = v - ((v >> 1) & 0x5555555555555555ull);
+  v = (v & 0x3333333333333333ull) + ((v >> 2) & 0x3333333333333333ull);
+  v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+  return (int)((v * 0x0101010101010101ull) >> 56);
+#endif
+}
+
+static inline uint8 bitReverse8(uint8 v) {
+  v = (uint8)((v >> 4) | (v << 4));
+  v = (uint8)(((v & 0xCC) >> 2) | ((v & 0x33) << 2));
+  return (uint8)(((v & 0xAA) >> 1) | ((v & 0x55) << 1));
+}
+
+// Compare row r2 of b2 with the bits of row r1 (stride1 words) starting at
+// bit x.  Each step extracts 64 bits of r1 at an arbitrary bit offset with
+// two shifts.
+static int bitRowMatch(const uint64_t* r1, int stride1, int x, const uint64_t* r2, Bitmap b2) {
+  const uint64_t* p = r1 + (x >> 6);
+  int s = x & 63;
+  int last = (int)(r1 + stride1 - p) - 1;  // last readable word index in p
+  for (int k = 0; k < b2->stride; k++) {
+    uint64_t m = (k == b2->stride - 1 && (b2->width & 63)) ? LASTMASK(b2) : ~(uint64_t)0;
+    uint64_t v = p[k] >> s;
+    if (s != 0 && k + 1 <= last) v |= p[k + 1] << (64 - s);
+    if ((v & m) != r2[k]) return 0;
+  }
+  return 1;
+}
+
+// Apply a word operation to all words of b1 with the words of b2
+#define BITMAP_WORDOP(b1, b2, OP) do { \
+    assert ((b1) != NULL && (b2) != NULL); \
+    assert ((b1)->width == (b2)->width && (b1)->height == (b2)->height); \
+    size_t words = (size_t)(b1)->stride * (b1)->height; \
+    uint64_t* restrict d = (b1)->bits; \
+    const uint64_t* restrict s = (b2)->bits; \
+    for (size_t k = 0; k < words; k++) d[k] = d[k] OP s[k]; \
+  } while (0)
+
+/// Create a new all-black (all 0) bitmap.
+/// Requires: width and height must be non-negative.
+Bitmap BitmapCreate(int width, int height) { ///
+  assert (width >= 0);
+  assert (height >= 0);
+  Bitmap b = malloc(sizeof(struct bitmap));
+  if (!check( b != NULL, "Allocating bitmap failed" )) {
+    return NULL;
+  }
+  b->width = width;
+  b->height = height;
+  b->stride = (width + 63) / 64;
+  b->bits = calloc((size_t)b->stride * height, sizeof(uint64_t));
+  if (!check( b->bits != NULL, "Allocating bits failed" )) {
+    errsave = errno;
+    free(b);
+    errno = errsave;
+    return NULL;
+  }
+  return b;
+}
+
+/// Destroy the bitmap pointed to by (*bmp).
+/// If (*bmp)==NULL, no operation is performed.
+/// Ensures: (*bmp)==NULL.
+void BitmapDestroy(Bitmap* bmp) { ///
+  assert (bmp != NULL);
+  if (*bmp == NULL) return;
+  free((*bmp)->bits);
+  free(*bmp);
+  *bmp = NULL;
+}
+
+/// Get bitmap width
+int BitmapWidth(Bitmap b) { ///
+  assert (b != NULL);
+  return b->width;
+}
+
+/// Get bitmap height
+int BitmapHeight(Bitmap b) { ///
+  assert (b != NULL);
+  return b->height;
+}
+
+/// Get the bit at position (x,y) (0 or 1).
+int BitmapGetBit(Bitmap b, int x, int y) { ///
+  assert (b != NULL);
+  assert (0 <= x && x < b->width && 0 <= y && y < b->height);
+  return (int)(BROW(b, y)[x >> 6] >> (x & 63)) & 1;
+}
+
+/// Set the bit at position (x,y) to bit (0 or nonzero).
+void BitmapSetBit(Bitmap b, int x, int y, int bit) { ///
+  assert (b != NULL);
+  assert (0 <= x && x < b->width && 0 <= y && y < b->height);
+  uint64_t m = (uint64_t)1 << (x & 63);
+  if (bit) BROW(b, y)[x >> 6] |= m;
+  else BROW(b, y)[x >> 6] &= ~m;
+}
+
+/// Create a bitmap from an image: bits are set where level >= thr,
+/// exactly the pixels ImageThreshold(img, thr) would make white.
+Bitmap BitmapFromImage(Image img, uint8 thr) { ///
+  assert (img != NULL);
+  materialize(img);
+  Bitmap b = BitmapCreate(img->width, img->height);
+  if (b == NULL) return NULL;
+  ImageLayout was = untile(img);
+  int w = img->width;
+  for (int y = 0; y < img->height; y++) {
+    const uint8* p = img->pixel + (size_t)y * w;
+    uint64_t* row = BROW(b, y);
+    for (int x0 = 0; x0 < w; x0 += 64) {
+      int n = w - x0 < 64 ? w - x0 : 64;
+      uint64_t word = 0;
+      for (int i = 0; i < n; i++) {
+        word |= (uint64_t)(p[x0 + i] >= thr) << i;
+      }
+      row[x0 >> 6] = word;
+    }
+  }
+  PIXMEM += (unsigned long)w * img->height;
+  retile(img, was);
+  return b;
+}
+
+/// Create an image from a bitmap: set bits become maxval, clear bits 0.
+Image BitmapToImage(Bitmap b, uint8 maxval) { ///
+  assert (b != NULL);
+  assert (0 < maxval && maxval <= PixMax);
+  Image img = ImageCreate(b->width, b->height, maxval);
+  if (img == NULL) return NULL;
+  int w = b->width;
+  for (int y = 0; y < b->height; y++) {
+    uint8* p = img->pixel + (size_t)y * w;
+    const uint64_t* row = BROW(b, y);
+    for (int x = 0; x < w; x++) {
+      p[x] = (uint8)(-(int)((row[x >> 6] >> (x & 63)) & 1) & maxval);
+    }
+  }
+  PIXMEM += (unsigned long)w * b->height;
+  return img;
+}
+
+/// Logical operations, in-place on b1: b1 = b1 AND b2, b1 OR b2, b1 XOR b2.
+/// Requires: b1 and b2 have the same size.
+void BitmapAnd(Bitmap b1, Bitmap b2) { ///
+  BITMAP_WORDOP(b1, b2, &);
+}
+
+void BitmapOr(Bitmap b1, Bitmap b2) { ///
+  BITMAP_WORDOP(b1, b2, |);
+}
+
+void BitmapXor(Bitmap b1, Bitmap b2) { ///
+  BITMAP_WORDOP(b1, b2, ^);
+}
+
+/// Logical negation, in-place: b = NOT b.
+void BitmapNot(Bitmap b) { ///
+  assert (b != NULL);
+  for (int y = 0; y < b->height; y++) {
+    uint64_t* row = BROW(b, y);
+    for (int k = 0; k < b->stride; k++) row[k] = ~row[k];
+    if (b->width & 63) row[b->stride - 1] &= LASTMASK(b);  // keep padding clear
+  }
+}
+
+/// Number of set bits (white pixels).
+uint64_t BitmapCount(Bitmap b) { ///
+  assert (b != NULL);
+  uint64_t n = 0;
+  size_t words = (size_t)b->stride * b->height;
+  for (size_t k = 0; k < words; k++) n += popcount64(b->bits[k]);
+  return n;
+}
+
+/// Paste b2 into position (x, y) of b1.
+/// Requires: b2 must fit inside b1 at position (x, y).
+void BitmapPaste(Bitmap b1, int x, int y, Bitmap b2) { ///
+  assert (b1 != NULL);
+  assert (b2 != NULL);
+  assert (x >= 0 && y >= 0 && x + b2->width <= b1->width && y + b2->height <= b1->height);
+  int s = x & 63;
+  for (int i = 0; i < b2->height; i++) {
+    uint64_t* dst = BROW(b1, y + i) + (x >> 6);
+    const uint64_t* src = BROW(b2, i);
+    for (int k = 0; k < b2->stride; k++) {
+      // Valid bits of this source word, and where they land in dst[k], dst[k+1]
+      uint64_t m = (k == b2->stride - 1 && (b2->width & 63)) ? LASTMASK(b2) : ~(uint64_t)0;
+      uint64_t v = src[k];
+      dst[k] = (dst[k] & ~(m << s)) | (v << s);
+      if (s != 0 && (m >> (64 - s)) != 0) {
+        dst[k + 1] = (dst[k + 1] & ~(m >> (64 - s))) | (v >> (64 - s));
+      }
+    }
+  }
+}
+
+/// Returns 1 (true) if b2 matches the sub-bitmap of b1 at pos (x, y).
+/// Requires: b2 must fit inside b1 at position (x, y).
+int BitmapMatchSub(Bitmap b1, int x, int y, Bitmap b2) { ///
+  assert (b1 != NULL);
+  assert (b2 != NULL);
+  assert (x >= 0 && y >= 0 && x + b2->width <= b1->width && y + b2->height <= b1->height);
+  for (int i = 0; i < b2->height; i++) {
+    if (!bitRowMatch(BROW(b1, y + i), b1->stride, x, BROW(b2, i), b2)) return 0;
+  }
+  return 1;
+}
+
+/// Locate b2 inside b1.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int BitmapLocateSub(Bitmap b1, int* px, int* py, Bitmap b2) { ///
+  assert (b1 != NULL);
+  assert (b2 != NULL);
+  assert (px != NULL && py != NULL);
+  for (int y = 0; y + b2->height <= b1->height; y++) {
+    for (int x = 0; x + b2->width <= b1->width; x++) {
+      if (BitmapMatchSub(b1, x, y, b2)) {
+        *px = x;
+        *py = y;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/// Save bitmap to a raw PBM (P4) file.
+/// PBM uses 1 for black, so white (set) pixels are written as 0 bits.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int BitmapSave(Bitmap b, const char* filename) { ///
+  assert (b != NULL);
+  int w = b->width;
+  int h = b->height;
+  size_t rowbytes = ((size_t)w + 7) / 8;
+  FILE* f = NULL;
+  uint8* line = NULL;
+
+  int success =
+  check( (line = malloc(rowbytes + 8)) != NULL, "Allocating line failed" ) &&
+  check( (f = fopen(filename, "wb")) != NULL, "Open failed" ) &&
+  check( fprintf(f, "P4\n%d %d\n", w, h) > 0, "Writing header failed" );
+  for (int y = 0; success && y < h; y++) {
+    // PBM rows are MSB-first bytes with 1 = black; ours are LSB-first, 1 = white
+    const uint64_t* row = BROW(b, y);
+    for (size_t j = 0; j < rowbytes; j++) {
+      line[j] = (uint8)~bitReverse8((uint8)(row[j >> 3] >> (8 * (j & 7))));
+    }
+    if (w & 7) line[rowbytes - 1] &= (uint8)(0xFF << (8 - (w & 7)));  // padding bits are 0
+    success = check( fwrite(line, 1, rowbytes, f) == rowbytes, "Writing pixels failed" );
+  }
+
+  // Cleanup
+  errsave = errno;
+  if (f != NULL) fclose(f);
+  free(line);
+  errno = errsave;
+  return success;
+}
+
+/// Run-length encoded images
+
+/// An RLEImage stores each row as a sequence of runs (length, level).
+/// Images with large uniform areas (document scans, masks) take a small
+/// fraction of the w*h bytes of an Image, and the operations below work
+/// directly on the runs, without decompressing.
+/// Success and failure of functions that allocate are treated as for
+/// images: NULL or 0 is returned and errno/errCause are set.
+
+// Internal structure for run-length encoded images.
+// Runs are stored in two parallel arrays, len[] and level[]; the runs of
+// row y are those with indices row[y] <= k < row[y+1], and their lengths
+// add up to the width.  Adjacent runs of a row always have different levels.
+struct rleimage {
+  int width;
+  int height;
+  int maxval;
+  size_t nruns;     // number of runs in use
+  size_t cap;       // capacity of len[] and level[]
+  uint32_t* len;
+  uint8* level;
+  size_t* row;      // height+1 run indices
+  size_t cur;       // first run of the row being built (see rlePush)
+};
+
+// Create an empty RLE image, ready to be filled with rleBeginRow/rlePush.
+static RLEImage rleNew(int width, int height, int maxval) {
+  RLEImage r = calloc(1, sizeof(struct rleimage));
+  if (!check( r != NULL, "Allocating RLE image failed" )) return NULL;
+  r->width = width;
+  r->height = height;
+  r->maxval = maxval;
+  if (!check( (r->row = calloc((size_t)height + 1, sizeof(size_t))) != NULL, "Allocating rows failed" )) {
+    errsave = errno;
+    free(r);
+    errno = errsave;
+    return NULL;
+  }
+  return r;
+}
+
+// Make room for at least n runs.
+static int rleReserve(RLEImage r, size_t n) {
+  if (n <= r->cap) return 1;
+  size_t cap = r->cap < 16 ? 16 : r->cap;
+  while (cap < n) cap *= 2;
+  uint32_t* len = realloc(r->len, cap * sizeof(uint32_t));
+  if (!check( len != NULL, "Allocating runs failed" )) return 0;
+  r->len = len;
+  uint8* level = realloc(r->level, cap * sizeof(uint8));
+  if (!check( level != NULL, "Allocating runs failed" )) return 0;
+  r->level = level;
+  r->cap = cap;
+  return 1;
+}
+
+// Start row y: the following pushes belong to it.
+static inline void rleBeginRow(RLEImage r, int y) {
+  r->row[y] = r->cur = r->nruns;
+}
+
+// Finish the last row.
+static inline void rleEndRows(RLEImage r) {
+  r->row[r->height] = r->nruns;
+}
+
+// Append a run to the row being built, merging it with the previous run
+// of that row if the level is the same.
+static int rlePush(RLEImage r, uint32_t len, uint8 level) {
+  if (len == 0) return 1;
+  if (r->nruns > r->cur && r->level[r->nruns - 1] == level) {
+    r->len[r->nruns - 1] += len;
+    return 1;
+  }
+  if (!rleReserve(r, r->nruns + 1)) return 0;
+  r->len[r->nruns] = len;
+  r->level[r->nruns] = level;
+  r->nruns++;
+  return 1;
+}
+
+// Append to the current row of dst the pixels [x0, x1) of row y of src.
+static int rleCopySpan(RLEImage dst, RLEImage src, int y, int x0, int x1) {
+  int x = 0;
+  for (size_t k = src->row[y]; k < src->row[y + 1] && x < x1; k++) {
+    int e = x + (int)src->len[k];
+    int a = x > x0 ? x : x0;
+    int b = e < x1 ? e : x1;
+    if (a < b && !rlePush(dst, (uint32_t)(b - a), src->level[k])) return 0;
+    x = e;
+  }
+  return 1;
+}
+
+/// Encode an image.
+RLEImage RLEFromImage(Image img) { ///
+  assert (img != NULL);
+  materialize(img);
+  ImageLayout was = untile(img);
+  RLEImage r = rleNew(img->width, img->height, img->maxval);
+  int success = r != NULL;
+  int w = img->width;
+  for (int y = 0; success && y < img->height; y++) {
+    const uint8* p = img->pixel + (size_t)y * w;
+    rleBeginRow(r, y);
+    int x = 0;
+    while (success && x < w) {
+      int x1 = x + 1;
+      while (x1 < w && p[x1] == p[x]) x1++;
+      success = rlePush(r, (uint32_t)(x1 - x), p[x]);
+      x = x1;
+    }
+  }
+  if (!success) {
+    RLEDestroy(&r);
+    retile(img, was);
+    return NULL;
+  }
+  rleEndRows(r);
+  PIXMEM += (unsigned long)w * img->height;
+  retile(img, was);
+  return r;
+}
+
+/// Decode into a new image.
+Image RLEToImage(RLEImage r) { ///
+  assert (r != NULL);
+  Image img = ImageCreate(r->width, r->height, (uint8)r->maxval);
+  if (img == NULL) return NULL;
+  for (int y = 0; y < r->height; y++) {
+    uint8* p = img->pixel + (size_t)y * r->width;
+    for (size_t k = r->row[y]; k < r->row[y + 1]; k++) {
+      memset(p, r->level[k], r->len[k]);
+      p += r->len[k];
+    }
+  }
+  PIXMEM += (unsigned long)r->width * r->height;
+  return img;
+}
+
+/// Destroy the RLE image pointed to by (*rp).
+/// If (*rp)==NULL, no operation is performed.
+/// Ensures: (*rp)==NULL.
+void RLEDestroy(RLEImage* rp) { ///
+  assert (rp != NULL);
+  if (*rp == NULL) return;
+  free((*rp)->len);
+  free((*rp)->level);
+  free((*rp)->row);
+  free(*rp);
+  *rp = NULL;
+}
+
+/// Get RLE image width
+int RLEWidth(RLEImage r) { ///
+  assert (r != NULL);
+  return r->width;
+}
+
+/// Get RLE image height
+int RLEHeight(RLEImage r) { ///
+  assert (r != NULL);
+  return r->height;
+}
+
+/// Total number of runs
+size_t RLERuns(RLEImage r) { ///
+  assert (r != NULL);
+  return r->nruns;
+}
+
+/// Memory used by the RLE image, in bytes (compare with w*h for an Image)
+size_t RLEBytes(RLEImage r) { ///
+  assert (r != NULL);
+  return sizeof(struct rleimage) + (size_t)(r->height + 1) * sizeof(size_t) +
+         r->cap * (sizeof(uint32_t) + sizeof(uint8));
+}
+
+/// Find the minimum and maximum gray levels, as ImageStats.
+void RLEStats(RLEImage r, uint8* min, uint8* max) { ///
+  assert (r != NULL);
+  uint8 lo = 255;
+  uint8 hi = 0;
+  for (size_t k = 0; k < r->nruns; k++) {
+    uint8 v = r->level[k];
+    lo = v < lo ? v : lo;
+    hi = v > hi ? v : hi;
+  }
+  *min = lo;
+  *max = hi;
+}
+
+/// Transform to negative, as ImageNegative.
+void RLENegative(RLEImage r) { ///
+  assert (r != NULL);
+  for (size_t k = 0; k < r->nruns; k++) {
+    r->level[k] = (uint8)(r->maxval - r->level[k]);
+  }
+}
+
+/// Apply threshold, as ImageThreshold.  Adjacent runs that become equal
+/// are merged, so this may reduce the number of runs.
+void RLEThreshold(RLEImage r, uint8 thr) { ///
+  assert (r != NULL);
+  // Rewrite in place, merging runs that end up equal: the write index never
+  // passes the read index.
+  size_t o = 0;
+  for (int y = 0; y < r->height; y++) {
+    size_t k0 = r->row[y], k1 = r->row[y + 1];
+    r->row[y] = o;
+    for (size_t k = k0; k < k1; k++) {
+      uint8 v = r->level[k] < thr ? 0 : (uint8)r->maxval;
+      if (o > r->row[y] && r->level[o - 1] == v) {
+        r->len[o - 1] += r->len[k];
+      } else {
+        r->level[o] = v;
+        r->len[o] = r->len[k];
+        o++;
+      }
     }
+  }
+  r->row[r->height] = r->nruns = o;
+}
 
-    // Copy the blurred image back to the original image
-    for (int i = 0; i < img->width * img->height; ++i) {
-        img->pixel[i] = blurredImg->pixel[i];
+/// Mirror left-right, as ImageMirror, returning a new RLE image.
+RLEImage RLEMirror(RLEImage r) { ///
+  assert (r != NULL);
+  RLEImage m = rleNew(r->width, r->height, r->maxval);
+  if (m == NULL || !rleReserve(m, r->nruns)) {
+    RLEDestroy(&m);
+    return NULL;
+  }
+  for (int y = 0; y < r->height; y++) {
+    rleBeginRow(m, y);
+    for (size_t k = r->row[y + 1]; k > r->row[y]; k--) {
+      rlePush(m, r->len[k - 1], r->level[k - 1]);  // cannot fail: reserved
     }
+  }
+  rleEndRows(m);
+  return m;
+}
+
+/// Crop a rectangle, as ImageCrop, returning a new RLE image.
+/// Requires: the rectangle must be inside r.
+RLEImage RLECrop(RLEImage r, int x, int y, int w, int h) { ///
+  assert (r != NULL);
+  assert (x >= 0 && y >= 0 && w >= 0 && h >= 0 && x + w <= r->width && y + h <= r->height);
+  RLEImage c = rleNew(w, h, r->maxval);
+  int success = c != NULL;
+  for (int i = 0; success && i < h; i++) {
+    rleBeginRow(c, i);
+    success = rleCopySpan(c, r, y + i, x, x + w);
+  }
+  if (!success) {
+    RLEDestroy(&c);
+    return NULL;
+  }
+  rleEndRows(c);
+  return c;
+}
 
-    // Destroy the temporary blurred image
-    ImageDestroy(&blurredImg);
-}
\ No newline at end of file
+/// Paste r2 into position (x, y) of r1, as ImagePaste.
+/// Requires: r2 must fit inside r1 at position (x, y).
+/// On success, returns nonzero.
+/// On failure (no memory for the new runs), returns 0 and r1 is unchanged.
+int RLEPaste(RLEImage r1, int x, int y, RLEImage r2) { ///
+  assert (r1 != NULL);
+  assert (r2 != NULL);
+  assert (x >= 0 && y >= 0 && x + r2->width <= r1->width && y + r2->height <= r1->height);
+  // Build the new rows of r1 into a fresh run list, then swap it in
+  RLEImage p = rleNew(r1->width, r1->height, r1->maxval);
+  int success = p != NULL && rleReserve(p, r1->nruns + r2->nruns + 2 * (size_t)r2->height);
+  for (int i = 0; success && i < r1->height; i++) {
+    rleBeginRow(p, i);
+    if (i < y || i >= y + r2->height) {
+      success = rleCopySpan(p, r1, i, 0, r1->width);
+    } else {
+      success =
+      rleCopySpan(p, r1, i, 0, x) &&
+      rleCopySpan(p, r2, i - y, 0, r2->width) &&
+      rleCopySpan(p, r1, i, x + r2->width, r1->width);
+    }
+  }
+  if (!success) {
+    RLEDestroy(&p);
+    return 0;
+  }
+  rleEndRows(p);
+  // Swap contents, so r1 (the caller's handle) gets the new runs
+  struct rleimage t = *r1;
+  *r1 = *p;
+  *p = t;
+  RLEDestroy(&p);
+  return 1;
+}
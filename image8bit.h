@@ -13,6 +13,8 @@
 #define IMAGE8BIT_H
 
 #include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
 
 // Type for pixel levels
 typedef uint8_t uint8;
@@ -20,9 +22,20 @@ typedef uint8_t uint8;
 // Maximum value you can store in a pixel (maximum maxval accepted)
 extern const uint8 PixMax;
 
+// Type for 16-bit sample levels, as in PGM files with maxval > 255
+typedef uint16_t uint16;
+
 // Type Image is a pointer to image objects
 typedef struct image *Image;
 
+// Pixel storage layouts:
+//   IMAGE_RASTER: rows one after the other (best for row operations);
+//   IMAGE_TILED: 64x64 tiles one after the other, each stored row by row
+//     (better locality for column accesses, rotations and 2D windows).
+// The layout is invisible to clients, except for performance: operations
+// that need raster order convert tiled images in place, and back.
+typedef enum { IMAGE_RASTER, IMAGE_TILED } ImageLayout;
+
 /// Error handling functions
 
 /// Error cause.
@@ -33,24 +46,66 @@ typedef struct image *Image;
 ///
 /// After a successful operation, the result is not garanteed (it might be
 /// the previous error cause).  It is not meant to be used in that situation!
+/// Like errno, the error cause is kept per thread.
 char* ImageErrMsg() ;
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Calibrate instrumentation, set names of counters, set the number of
+/// worker threads to the number of online CPUs (or to $IMAGE_THREADS), and
+/// select the best SIMD kernels for this CPU (or the level named in
+/// $IMAGE_SIMD, if it is supported).
 void ImageInit(void) ;
 
+/// Set the maximum number of threads used by operations that run in
+/// parallel (their documentation says so).
+/// Requires: n >= 1.
+void ImageSetThreads(int n) ;
+
+/// Get the maximum number of threads used by parallel operations.
+int ImageThreads(void) ;
+
+/// SIMD levels of the pixel kernels, from slowest to fastest.
+/// IMAGE_SIMD_SCALAR works on any CPU; the others need x86 CPUs with
+/// SSE4.1, AVX2, or AVX-512 (F and BW).
+typedef enum {
+  IMAGE_SIMD_SCALAR, IMAGE_SIMD_SSE4, IMAGE_SIMD_AVX2, IMAGE_SIMD_AVX512
+} ImageSIMDLevel;
+
+/// Name of a SIMD level: "scalar", "sse4", "avx2" or "avx512".
+const char* ImageSIMDName(ImageSIMDLevel level) ;
+
+/// The highest SIMD level supported by this CPU (and build).
+ImageSIMDLevel ImageBestSIMD(void) ;
+
+/// Use the kernels of the given SIMD level from now on.
+/// All levels produce exactly the same results; only speed differs.
+/// On success, returns nonzero.
+/// On failure (level not supported by this CPU), returns 0, sets errCause,
+/// and keeps the current level.
+int ImageSetSIMD(ImageSIMDLevel level) ;
+
+/// The SIMD level in use.
+ImageSIMDLevel ImageGetSIMD(void) ;
+
 /// Image management functions
 
 /// Create a new black image.
 ///   width, height : the dimensions of the new image.
 ///   maxval: the maximum gray level (corresponding to white).
 /// Requires: width and height must be non-negative, maxval > 0.
+/// Pixel counts and indices are size_t, so width*height may exceed 2^31
+/// (each dimension is an int).  The pixel array is allocated lazily by
+/// calloc, so a huge image only takes memory for the pages written.
 /// 
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCreate(int width, int height, uint8 maxval) ;
 
+/// Create a new black image with the given pixel layout.
+/// Otherwise, as ImageCreate.
+Image ImageCreateLayout(int width, int height, uint8 maxval, ImageLayout layout) ;
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -58,21 +113,101 @@ Image ImageCreate(int width, int height, uint8 maxval) ;
 /// Should never fail, and should preserve global errno/errCause.
 void ImageDestroy(Image* imgp) ;
 
+/// Get the pixel layout of img.
+ImageLayout ImageGetLayout(Image img) ;
+
+/// Convert img to the given pixel layout, in place.
+/// Converting to IMAGE_TILED allocates a scratch band of 64 rows.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set accordingly, and img is
+/// left unchanged.
+int ImageSetLayout(Image img, ImageLayout layout) ;
+
 /// PGM file operations
 
-/// Load a raw PGM file.
-/// Only 8 bit PGM files are accepted.
+/// Load a PGM file.
+/// Raw (P5) and plain (P2) files are accepted, with maxval up to 65535.
+/// Levels of files with maxval above PixMax (16-bit samples) are rescaled
+/// to [0, PixMax], rounded to the nearest level.
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) ;
 
+/// Load a PGM file into an image with the given pixel layout.
+/// Otherwise, as ImageLoad.
+Image ImageLoadLayout(const char* filename, ImageLayout layout) ;
+
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
 /// a partial and invalid file may be left in the system.
 int ImageSave(Image img, const char* filename) ;
 
+/// Skip whitespace in stream f and check whether it has ended.
+/// Returns nonzero if no more data (no more frames) follow, or on a read
+/// error (distinguish with ferror(f)); returns 0 if a frame may follow.
+int ImageStreamEnd(FILE* f) ;
+
+/// Read one PGM image (raw or plain, as ImageLoad) from stream f.
+/// A stream may hold several images (frames), one after the other, as in
+/// the PGM specification; each call reads the next one, leaving f at the
+/// byte following its pixels.  Use ImageStreamEnd to detect the end.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly, and
+/// the position of f is undefined.
+Image ImageRead(FILE* f) ;
+
+/// Read one PGM image from stream f into an image with the given
+/// pixel layout.  Otherwise, as ImageRead.
+Image ImageReadLayout(FILE* f, ImageLayout layout) ;
+
+/// Write image to stream f, as one raw PGM frame.
+/// Frames written one after the other form a multi-image PGM stream
+/// (see ImageRead).  The stream is not flushed.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set appropriately.
+int ImageWrite(Image img, FILE* f) ;
+
+/// Save image to PGM file with 16-bit samples (see ImageWrite16).
+/// Otherwise, as ImageSave.
+int ImageSave16(Image img, const char* filename, int maxval) ;
+
+/// Write image to stream f, as one raw PGM frame with 16-bit samples
+/// (big-endian, two bytes each) and the given maxval.
+/// Levels are rescaled from [0, maxval of img] to [0, maxval], rounded
+/// to the nearest level.
+/// Requires: PixMax < maxval <= 65535.
+/// Otherwise, as ImageWrite.
+int ImageWrite16(Image img, FILE* f, int maxval) ;
+
+/// Convert n 16-bit samples with levels in [0, srcMaxval] to pixel levels
+/// in [0, maxval], rounded to the nearest level (samples above srcMaxval
+/// count as srcMaxval).  Runs with the SIMD level in use (see ImageSetSIMD).
+void ImageNarrow16(uint8* dst, const uint16* src, size_t n, int srcMaxval, uint8 maxval) ;
+
+/// Asynchronous save
+
+/// Handle of a save running in the background (see ImageSaveAsync).
+typedef struct imageSaveJob *ImageSaveJob;
+
+/// Save image to PGM file in the background.
+/// A snapshot (copy) of img is taken before returning, so img may be
+/// modified or destroyed right away, while a new thread writes the
+/// snapshot to filename.
+/// On success, returns a handle, which must be passed to ImageSaveWait.
+/// On failure (no memory for the snapshot, or no thread), returns NULL
+/// and errno/errCause are set accordingly; nothing is written.
+ImageSaveJob ImageSaveAsync(Image img, const char* filename) ;
+
+/// Wait for the save job (*jobp) to finish, and release it.
+/// Returns what ImageSave would have returned: on success, nonzero (and
+/// errno/errCause are left unchanged); on failure, 0, with errno/errCause
+/// set as ImageSave left them.
+/// Ensures: (*jobp)==NULL.
+int ImageSaveWait(ImageSaveJob* jobp) ;
+
 /// Information queries
 
 /// These functions do not modify the image and never fail.
@@ -93,6 +228,10 @@ int ImageMaxval(Image img) ;
 /// *max is set to the maximum.
 void ImageStats(Image img, uint8* min, uint8* max) ;
 
+/// Gray level histogram.
+/// On return, hist[v] is the number of pixels with level v, for v in 0..255.
+void ImageHistogram(Image img, uint64_t hist[256]) ;
+
 /// Check if pixel position (x,y) is inside img.
 int ImageValidPos(Image img, int x, int y) ;
 
@@ -124,17 +263,42 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) ;
 /// resulting in a "photographic negative" effect.
 void ImageNegative(Image img) ;
 
+/// Transform the rectangle (x,y,w,h) of img to negative, as ImageNegative.
+/// Requires: the rectangle must be inside img.
+void ImageNegativeRect(Image img, int x, int y, int w, int h) ;
+
 /// Apply threshold to image.
 /// Transform all pixels with level<thr to black (0) and
 /// all pixels with level>=thr to white (maxval).
 void ImageThreshold(Image img, uint8 thr) ;
 
+/// Apply threshold to the rectangle (x,y,w,h) of img, as ImageThreshold.
+/// Requires: the rectangle must be inside img.
+void ImageThresholdRect(Image img, int x, int y, int w, int h, uint8 thr) ;
+
 /// Brighten image by a factor.
 /// Multiply each pixel level by a factor, but saturate at maxval.
 /// This will brighten the image if factor>1.0 and
 /// darken the image if factor<1.0.
 void ImageBrighten(Image img, double factor) ;
 
+/// Brighten the rectangle (x,y,w,h) of img by a factor, as ImageBrighten.
+/// Requires: the rectangle must be inside img.
+void ImageBrightenRect(Image img, int x, int y, int w, int h, double factor) ;
+
+/// Stretch contrast to the full range [0, maxval].
+/// Levels are mapped linearly so that the level below which a fraction clip
+/// of the pixels lies becomes 0, and the level above which a fraction clip
+/// lies becomes maxval (clip = 0.0 uses the actual min and max levels).
+/// Requires: 0.0 <= clip < 0.5.
+void ImageAutoContrast(Image img, double clip) ;
+
+/// Equalize the histogram.
+/// Levels are remapped through the normalized cumulative histogram, so
+/// that the result's levels are spread as uniformly as possible over
+/// [0, maxval].
+void ImageEqualize(Image img) ;
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -144,6 +308,11 @@ void ImageBrighten(Image img, double factor) ;
 /// On success, a new image is returned.
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
+///
+/// Rotations and flips are lazy: the new image shares the pixels of the
+/// original (with a tag recording the orientation) until either of them
+/// is modified or destroyed, or the new image's pixels are needed in
+/// raster order.  Chains of these operations copy pixels at most once.
 
 /// Rotate an image.
 /// Returns a rotated version of the image.
@@ -155,6 +324,19 @@ void ImageBrighten(Image img, double factor) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img) ;
 
+/// Rotate an image 180 degrees.
+/// Otherwise, as ImageRotate.
+Image ImageRotate180(Image img) ;
+
+/// Rotate an image 270 degrees anti-clockwise (90 degrees clockwise).
+/// Otherwise, as ImageRotate.
+Image ImageRotate270(Image img) ;
+
+/// Transpose an image = flip about the main diagonal: pixel (x,y) of the
+/// result is pixel (y,x) of img.
+/// Otherwise, as ImageRotate.
+Image ImageTranspose(Image img) ;
+
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
@@ -164,6 +346,10 @@ Image ImageRotate(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageMirror(Image img) ;
 
+/// Flip an image top-bottom.
+/// Otherwise, as ImageMirror.
+Image ImageFlip(Image img) ;
+
 /// Crop a rectangular subimage from img.
 /// The rectangle is specified by the top left corner coords (x, y) and
 /// width w and height h.
@@ -178,6 +364,29 @@ Image ImageMirror(Image img) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageCrop(Image img, int x, int y, int w, int h) ;
 
+/// Resampling modes of ImageResize
+typedef enum {
+  IMAGE_RESIZE_NEAREST,
+  IMAGE_RESIZE_BILINEAR,
+  IMAGE_RESIZE_AREA,
+} ImageResizeMode;
+
+/// Resize an image to width w and height h, resampling in mode:
+///   IMAGE_RESIZE_NEAREST: each pixel copies the nearest source pixel;
+///   IMAGE_RESIZE_BILINEAR: interpolates the 2x2 nearest source pixels;
+///   IMAGE_RESIZE_AREA: averages the source pixels the new pixel covers,
+///     weighted by their covered area (best for shrinking).
+/// Filters run separably in fixed point (results may differ from exact
+/// arithmetic by one level), on strips of rows in parallel (see
+/// ImageSetThreads).
+/// Requires: img is not empty; w > 0; h > 0.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned, with the maxval and layout of img.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageResize(Image img, int w, int h, ImageResizeMode mode) ;
+
 /// Operations on two images
 
 /// Paste an image into a larger image.
@@ -186,14 +395,59 @@ Image ImageCrop(Image img, int x, int y, int w, int h) ;
 /// Requires: img2 must fit inside img1 at position (x, y).
 void ImagePaste(Image img1, int x, int y, Image img2) ;
 
+/// A placement for ImagePasteMany: img with its top left corner at (x, y)
+/// of the destination.
+typedef struct {
+  Image img;
+  int x, y;
+} ImagePlacement;
+
+/// Paste several images into img.
+/// The result is the same as pasting places[0], places[1], ...,
+/// places[n-1] into img in this order (where placements overlap, the last
+/// one wins), but placements are sorted by destination band of rows, and
+/// bands are pasted by row copies, in parallel (see ImageSetThreads).
+/// This modifies img in-place.  (If the band lists cannot be allocated,
+/// images are pasted one by one: slower, same result.)
+/// Requires: every image must fit inside img at its position, and none
+/// may be img itself.
+void ImagePasteMany(Image img, const ImagePlacement* places, int n) ;
+
 /// Blend an image into a larger image.
 /// Blend img2 into position (x, y) of img1.
 /// This modifies img1 in-place: no allocation involved.
 /// Requires: img2 must fit inside img1 at position (x, y).
 /// alpha usually is in [0.0, 1.0], but values outside that interval
 /// may provide interesting effects.  Over/underflows should saturate.
+/// Each result is (1-alpha)*p1 + alpha*p2, saturated to [0, maxval] of img1
+/// and rounded to the nearest level.
 void ImageBlend(Image img1, int x, int y, Image img2, double alpha) ;
 
+/// A layer for ImageComposite.
+/// img is placed with its top left corner at (x, y) of the destination.
+/// mask, if not NULL, has the same size as img and gives per-pixel opacity:
+/// a mask level m weighs img by alpha*m/maxval(mask), computed in fixed
+/// point with 1/65536 resolution.
+/// Without a mask, the layer is blended exactly as ImageBlend would.
+typedef struct {
+  Image img;
+  Image mask;
+  int x, y;
+  double alpha;
+} ImageLayer;
+
+/// Composite several layers into img in a single pass.
+/// The result is the same as blending layers[0], layers[1], ...,
+/// layers[n-1] into img in this order, but layers are sorted by row of
+/// tiles of img, and each tile is read and written only once for all the
+/// layers over it.
+/// This modifies img in-place.  (If the tile row lists cannot be
+/// allocated, layers are blended one by one: slower, same result.)
+/// Requires: every layer must fit inside img at its position,
+/// every mask must have the size of its layer, and no layer image or
+/// mask may be img itself.
+void ImageComposite(Image img, const ImageLayer* layers, int n) ;
+
 /// Compare an image to a subimage of a larger image.
 /// Returns 1 (true) if img2 matches subimage of img1 at pos (x, y).
 /// Returns 0, otherwise.
@@ -205,12 +459,294 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Find the first pixel, in raster order, where two images differ.
+/// If one is found, returns 1 and its position is set in (*px, *py)
+/// (unless they are NULL).
+/// If all pixels are equal, returns 0 and (*px, *py) are left untouched.
+/// The search stops at the first difference.
+/// Requires: img1 and img2 have the same size.
+int ImageFindDiff(Image img1, Image img2, int* px, int* py) ;
+
+/// Check whether two images are equal: same size, same maxval and same
+/// pixels (so ImageSave would write identical files).
+/// The comparison stops at the first difference.
+int ImageEquals(Image img1, Image img2) ;
+
+/// Absolute difference of two images.
+/// Pixel (x,y) of the result is |img1(x,y) - img2(x,y)|, and its maxval is
+/// the larger of theirs.  The result has the layout of img1.
+/// Requires: img1 and img2 have the same size.
+/// Ensures: img1 and img2 are not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageDiff(Image img1, Image img2) ;
+
+/// Maximum absolute difference between pixels of two images (0 if they
+/// have the same pixels).
+/// Requires: img1 and img2 have the same size.
+int ImageMaxAbsDiff(Image img1, Image img2) ;
+
+/// Peak signal-to-noise ratio of img2 with respect to the reference img1,
+/// in dB: 10*log10(maxval^2/MSE), where maxval is that of img1 and MSE is
+/// the mean squared difference of their pixels.
+/// Returns INFINITY if the pixels are all equal (or the images are empty).
+/// Requires: img1 and img2 have the same size.
+double ImagePSNR(Image img1, Image img2) ;
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
-/// [x-dx, x+dx]x[y-dy, y+dy].
+/// [x-dx, x+dx]x[y-dy, y+dy] that are inside the image, truncated to an
+/// integer level.
+/// The image is changed in-place.
+/// Requires: dx >= 0, dy >= 0.
+/// On success, returns nonzero.
+/// On failure (no memory for the running column sums or the output
+/// raster), returns 0 with the image unchanged, and errno/errCause are set
+/// accordingly.
+int ImageBlur(Image img, int dx, int dy) ;
+
+/// Blur the rectangle (x,y,w,h) of img, as ImageBlur.
+/// Only pixels inside the rectangle change, but their windows include
+/// pixels outside it (up to dx columns and dy rows around it).
+/// Requires: the rectangle must be inside img, dx >= 0, dy >= 0.
+/// Success and failure are treated as in ImageBlur.
+int ImageBlurRect(Image img, int x, int y, int w, int h, int dx, int dy) ;
+
+/// Apply a (2dx+1)x(2dy+1) median filter.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that are inside the image (near the borders
+/// the window is truncated, as in ImageBlur).  For an even number of pixels
+/// the lower median is used.
+/// Cost per pixel is independent of dx and dy.
+/// Requires: dx >= 0, dy >= 0.
 /// The image is changed in-place.
-void ImageBlur(Image img, int dx, int dy) ;
+/// On success, returns nonzero.
+/// On failure (no memory for the work buffers), returns 0, the image is
+/// unchanged and errno/errCause are set accordingly.
+int ImageMedian(Image img, int dx, int dy) ;
+
+/// Grayscale erosion with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the minimum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that are inside the image.
+/// Cost per pixel is independent of dx and dy.
+/// Requires: dx >= 0, dy >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (no memory for the work buffer), returns 0 and
+/// errno/errCause are set accordingly.
+int ImageErode(Image img, int dx, int dy) ;
+
+/// Grayscale dilation with a (2dx+1)x(2dy+1) rectangle.
+/// Each pixel is substituted by the maximum of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy] that are inside the image.
+/// Cost per pixel is independent of dx and dy.
+/// Requires: dx >= 0, dy >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (no memory for the work buffer), returns 0 and
+/// errno/errCause are set accordingly.
+int ImageDilate(Image img, int dx, int dy) ;
+
+/// Morphological opening: erosion followed by dilation, same rectangle.
+/// Removes bright details smaller than the rectangle.
+/// Cost per pixel is independent of dx and dy.
+/// Requires: dx >= 0, dy >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (no memory for the work buffer), returns 0 and
+/// errno/errCause are set accordingly.
+int ImageOpen(Image img, int dx, int dy) ;
+
+/// Morphological closing: dilation followed by erosion, same rectangle.
+/// Fills dark details smaller than the rectangle.
+/// Cost per pixel is independent of dx and dy.
+/// Requires: dx >= 0, dy >= 0.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (no memory for the work buffer), returns 0 and
+/// errno/errCause are set accordingly.
+int ImageClose(Image img, int dx, int dy) ;
+
+/// Convolve the image with an integer kernel.
+///   kernel: kh rows of kw integer coefficients (row-major), centered on
+///     the pixel, so kw and kh must be odd.
+/// Each pixel is substituted by
+///   round(sum(kernel[i][j] * p[y+i-kh/2][x+j-kw/2]) / divisor) + bias,
+/// saturated to [0, maxval], where positions outside the image take the
+/// value of the nearest border pixel.
+/// Accumulation is exact, in 32-bit integers.
+/// Requires: kw, kh odd and positive, divisor > 0,
+///   and sum(|kernel[i][j]|) * maxval must fit in an int32.
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (no memory for the work buffers), returns 0 and
+/// errno/errCause are set accordingly.
+int ImageConvolve(Image img, const int* kernel, int kw, int kh, int divisor, int bias) ;
+
+/// Sobel edge magnitude.
+/// Each pixel is substituted by |Gx| + |Gy|, saturated to maxval, where
+/// Gx and Gy are the horizontal and vertical 3x3 Sobel derivatives
+/// (with border pixels replicated, as in ImageConvolve).
+/// The image is changed in-place.
+/// On success, returns nonzero.
+/// On failure (no memory for the work buffers), returns 0 and
+/// errno/errCause are set accordingly.
+int ImageSobel(Image img) ;
+
+/// Statistics of a connected component (see ImageLabelComponents).
+typedef struct {
+  uint64_t area;        // number of pixels
+  int xmin, ymin;       // bounding box, inclusive
+  int xmax, ymax;
+  double cx, cy;        // centroid
+} ImageComponent;
+
+/// Label the connected components of nonzero pixels.
+///   connectivity: 4 or 8.
+///   labels: if not NULL, *labels is set to a new array of w*h labels in
+///     raster order: 0 for background, 1..n for the components.
+///   comps: if not NULL, *comps is set to a new array of n component stats,
+///     (*comps)[i] describing label i+1.
+/// Components are numbered in raster order of their first pixel.
+/// The work is split in horizontal strips labelled in parallel (see
+/// ImageSetThreads) and merged at strip boundaries.
+/// (The caller is responsible for freeing *labels and *comps with free()!)
+/// On success, returns the number of components n.
+/// On failure, returns -1 and errno/errCause are set accordingly.
+long ImageLabelComponents(Image img, int connectivity, uint32_t** labels, ImageComponent** comps) ;
+
+/// Binary images
+
+/// A Bitmap is a binary image stored with 1 bit per pixel, packed in 64-bit
+/// words, so that logical operations, counting, pasting and matching work
+/// on 64 pixels per word operation.
+/// A set bit (1) is a white (foreground) pixel, a clear bit (0) is black.
+/// Success and failure of functions that allocate or do I/O are treated as
+/// for images: NULL or 0 is returned and errno/errCause are set.
+
+// Type Bitmap is a pointer to bitmap objects
+typedef struct bitmap *Bitmap;
+
+/// Create a new all-black (all 0) bitmap.
+/// Requires: width and height must be non-negative.
+Bitmap BitmapCreate(int width, int height) ;
+
+/// Destroy the bitmap pointed to by (*bmp).
+/// If (*bmp)==NULL, no operation is performed.
+/// Ensures: (*bmp)==NULL.
+void BitmapDestroy(Bitmap* bmp) ;
+
+/// Get bitmap width
+int BitmapWidth(Bitmap b) ;
+
+/// Get bitmap height
+int BitmapHeight(Bitmap b) ;
+
+/// Get the bit at position (x,y) (0 or 1).
+int BitmapGetBit(Bitmap b, int x, int y) ;
+
+/// Set the bit at position (x,y) to bit (0 or nonzero).
+void BitmapSetBit(Bitmap b, int x, int y, int bit) ;
+
+/// Create a bitmap from an image: bits are set where level >= thr,
+/// exactly the pixels ImageThreshold(img, thr) would make white.
+Bitmap BitmapFromImage(Image img, uint8 thr) ;
+
+/// Create an image from a bitmap: set bits become maxval, clear bits 0.
+Image BitmapToImage(Bitmap b, uint8 maxval) ;
+
+/// Logical operations, in-place on b1: b1 = b1 AND b2, b1 OR b2, b1 XOR b2.
+/// Requires: b1 and b2 have the same size.
+void BitmapAnd(Bitmap b1, Bitmap b2) ;
+void BitmapOr(Bitmap b1, Bitmap b2) ;
+void BitmapXor(Bitmap b1, Bitmap b2) ;
+
+/// Logical negation, in-place: b = NOT b.
+void BitmapNot(Bitmap b) ;
+
+/// Number of set bits (white pixels).
+uint64_t BitmapCount(Bitmap b) ;
+
+/// Paste b2 into position (x, y) of b1.
+/// Requires: b2 must fit inside b1 at position (x, y).
+void BitmapPaste(Bitmap b1, int x, int y, Bitmap b2) ;
+
+/// Returns 1 (true) if b2 matches the sub-bitmap of b1 at pos (x, y).
+/// Requires: b2 must fit inside b1 at position (x, y).
+int BitmapMatchSub(Bitmap b1, int x, int y, Bitmap b2) ;
+
+/// Locate b2 inside b1.
+/// If a match is found, returns 1 and matching position is set in vars (*px, *py).
+/// If no match is found, returns 0 and (*px, *py) are left untouched.
+int BitmapLocateSub(Bitmap b1, int* px, int* py, Bitmap b2) ;
+
+/// Save bitmap to a raw PBM (P4) file.
+/// PBM uses 1 for black, so white (set) pixels are written as 0 bits.
+/// On success, returns nonzero.
+/// On failure, returns 0, errno/errCause are set appropriately, and
+/// a partial and invalid file may be left in the system.
+int BitmapSave(Bitmap b, const char* filename) ;
+
+/// Run-length encoded images
+
+/// An RLEImage stores each row as a sequence of runs (length, level).
+/// Images with large uniform areas (document scans, masks) take a small
+/// fraction of the w*h bytes of an Image, and the operations below work
+/// directly on the runs, without decompressing.
+/// Success and failure of functions that allocate are treated as for
+/// images: NULL or 0 is returned and errno/errCause are set.
+
+// Type RLEImage is a pointer to run-length encoded image objects
+typedef struct rleimage *RLEImage;
+
+/// Encode an image.
+RLEImage RLEFromImage(Image img) ;
+
+/// Decode into a new image.
+Image RLEToImage(RLEImage r) ;
+
+/// Destroy the RLE image pointed to by (*rp).
+/// If (*rp)==NULL, no operation is performed.
+/// Ensures: (*rp)==NULL.
+void RLEDestroy(RLEImage* rp) ;
+
+/// Get RLE image width
+int RLEWidth(RLEImage r) ;
+
+/// Get RLE image height
+int RLEHeight(RLEImage r) ;
+
+/// Total number of runs
+size_t RLERuns(RLEImage r) ;
+
+/// Memory used by the RLE image, in bytes (compare with w*h for an Image)
+size_t RLEBytes(RLEImage r) ;
+
+/// Find the minimum and maximum gray levels, as ImageStats.
+void RLEStats(RLEImage r, uint8* min, uint8* max) ;
+
+/// Transform to negative, as ImageNegative.
+void RLENegative(RLEImage r) ;
+
+/// Apply threshold, as ImageThreshold.  Adjacent runs that become equal
+/// are merged, so this may reduce the number of runs.
+void RLEThreshold(RLEImage r, uint8 thr) ;
+
+/// Mirror left-right, as ImageMirror, returning a new RLE image.
+RLEImage RLEMirror(RLEImage r) ;
+
+/// Crop a rectangle, as ImageCrop, returning a new RLE image.
+/// Requires: the rectangle must be inside r.
+RLEImage RLECrop(RLEImage r, int x, int y, int w, int h) ;
+
+/// Paste r2 into position (x, y) of r1, as ImagePaste.
+/// Requires: r2 must fit inside r1 at position (x, y).
+/// On success, returns nonzero.
+/// On failure (no memory for the new runs), returns 0 and r1 is unchanged.
+int RLEPaste(RLEImage r1, int x, int y, RLEImage r2) ;
 
 #endif
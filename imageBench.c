@@ -0,0 +1,660 @@
+// imageBench - Time the image8bit operations on synthetic images.
+//
+// Every operation is run on synthetic images of several sizes (from a
+// thumbnail to a gigapixel) and patterns (noise, gradient, uniform), and,
+// where it has one, with several values of its main parameter (blur
+// radius, template size, ...).  Each measurement does a few warm-up runs,
+// then repeats the operation at least MINREPS times and for at least
+// MINTIME seconds.  Results go to stdout as CSV, one line per measurement:
+//
+//   op,arg,size,width,height,pattern,simd,threads,reps,
+//   median_ns,min_ns,cpu_ns,ns_per_pixel,gb_per_s,<counters...>
+//
+// Times are per run: median and minimum wall-clock time and median cpu
+// time (of all threads).  ns_per_pixel is the median over width*height,
+// gb_per_s the pixel memory accesses counted by PIXMEM (1 byte each) per
+// median time, and the counters are the named InstrCount values per run.
+//
+// Usage: imageBench [-s SIZES] [-p PATTERNS] [-o OPS] [-r MINREPS]
+//                   [-t MINTIME] [-w WARMUP] [-c BASELINE [-T PCT]]
+//   SIZES, PATTERNS and OPS are comma-separated lists of names.
+//   Sizes: thumb, vga, hd, 4k, giga or WxH (default thumb,vga,hd,4k).
+//   Patterns: noise, gradient, uniform (default all).
+//   Ops: names from the op column (default all).
+// The giga size (32768x32768) needs several GB of memory, so it only
+// runs when asked for.  SIMD level and threads are those set by ImageInit
+// (see IMAGE_SIMD and IMAGE_THREADS).
+//
+// With -c, results are not printed as CSV but compared with those in
+// BASELINE (a CSV file from an earlier run), measurement by measurement:
+// a regression is a median time or a counter more than PCT percent
+// (default 10) above the baseline.  A table of all differences is printed,
+// and the exit status is 1 if there was any regression.
+// (See the benchbase and benchcheck targets in the Makefile.)
+
+#include <errno.h>
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+// Named sizes
+typedef struct {
+  const char* name;
+  int width, height;
+  int byDefault;
+} Size;
+
+static const Size sizes[] = {
+  { "thumb", 160, 120, 1 },
+  { "vga", 640, 480, 1 },
+  { "hd", 1920, 1080, 1 },
+  { "4k", 3840, 2160, 1 },
+  { "giga", 32768, 32768, 0 },
+};
+#define NSIZES (int)(sizeof(sizes) / sizeof(sizes[0]))
+
+static const char* patterns[] = { "noise", "gradient", "uniform" };
+#define NPATTERNS 3
+
+// Template sizes for locate and match
+static const int templateSizes[] = { 8, 32 };
+#define NTEMPLATES 2
+
+// The inputs of one benchmark: all derived from a synthetic image.
+typedef struct {
+  Image src;    // the synthetic image (never modified)
+  Image work;   // scratch copy of src, for in-place operations
+  Image patch;  // a quarter-size image of another pattern
+  Image mask;   // a gradient mask for patch
+  Image bin;    // src thresholded at maxval/2 (for labeling)
+  Image tmpl[NTEMPLATES];  // templates cut from src's bottom-right corner
+} Inputs;
+
+// An operation: run(in, param) runs it once.
+// In-place operations work on in->work, which is a fresh copy of in->src
+// before the warm-up runs; repeated runs then keep changing it, which costs
+// the same for all these operations.
+typedef struct {
+  const char* name;
+  const char* arg;  // param as shown in the CSV
+  int param;
+  int inPlace;
+  void (*run)(Inputs* in, int param);
+} Op;
+
+static void check(int ok, const char* what) {
+  if (!ok) error(2, errno, "%s: %s", what, ImageErrMsg());
+}
+
+static void opStats(Inputs* in, int param) {
+  uint8 min, max;
+  ImageStats(in->src, &min, &max);
+}
+
+static void opHistogram(Inputs* in, int param) {
+  uint64_t hist[256];
+  ImageHistogram(in->src, hist);
+}
+
+static void opNegative(Inputs* in, int param) { ImageNegative(in->work); }
+static void opThreshold(Inputs* in, int param) { ImageThreshold(in->work, (uint8)param); }
+static void opBrighten(Inputs* in, int param) { ImageBrighten(in->work, param / 100.0); }
+static void opAutoContrast(Inputs* in, int param) { ImageAutoContrast(in->work, param / 100.0); }
+static void opEqualize(Inputs* in, int param) { ImageEqualize(in->work); }
+
+// ROI variants work on the central quarter of the image
+static void opNegativeRect(Inputs* in, int param) {
+  int w = ImageWidth(in->work), h = ImageHeight(in->work);
+  ImageNegativeRect(in->work, w / 4, h / 4, w / 2, h / 2);
+}
+
+static void opBlurRect(Inputs* in, int param) {
+  int w = ImageWidth(in->work), h = ImageHeight(in->work);
+  check(ImageBlurRect(in->work, w / 4, h / 4, w / 2, h / 2, param, param), "Blurring");
+}
+
+// Orientations: the view is O(1), so also copy it, as a consumer would
+static void opOrient(Inputs* in, int param) {
+  Image (*orient[])(Image) = {
+    ImageRotate, ImageRotate180, ImageRotate270, ImageTranspose, ImageMirror, ImageFlip,
+  };
+  Image v = orient[param](in->src);
+  check(v != NULL, "Orienting");
+  Image c = ImageCrop(v, 0, 0, ImageWidth(v), ImageHeight(v));
+  check(c != NULL, "Copying");
+  ImageDestroy(&c);
+  ImageDestroy(&v);
+}
+
+static void opCrop(Inputs* in, int param) {
+  int w = ImageWidth(in->src), h = ImageHeight(in->src);
+  Image c = ImageCrop(in->src, w / 4, h / 4, w / 2, h / 2);
+  check(c != NULL, "Cropping");
+  ImageDestroy(&c);
+}
+
+// Resize to param percent of the size in each direction
+static void opResize(Inputs* in, int param) {
+  int w = ImageWidth(in->src) * (param / 10) / 100;
+  int h = ImageHeight(in->src) * (param / 10) / 100;
+  Image r = ImageResize(in->src, w > 0 ? w : 1, h > 0 ? h : 1, param % 10);
+  check(r != NULL, "Resizing");
+  ImageDestroy(&r);
+}
+
+// Paste template param at PASTES pseudo-random positions of work, in one batch
+#define PASTES 4096
+static void opPasteMany(Inputs* in, int param) {
+  static ImagePlacement places[PASTES];
+  Image t = in->tmpl[param];
+  int w = ImageWidth(in->work) - ImageWidth(t) + 1;
+  int h = ImageHeight(in->work) - ImageHeight(t) + 1;
+  uint32_t seed = 12345u;
+  for (int i = 0; i < PASTES; i++) {
+    seed = seed * 1103515245u + 12345u;
+    places[i].img = t;
+    places[i].x = (int)((seed >> 8) % (uint32_t)w);
+    seed = seed * 1103515245u + 12345u;
+    places[i].y = (int)((seed >> 8) % (uint32_t)h);
+  }
+  ImagePasteMany(in->work, places, PASTES);
+}
+
+// Comparisons of src with work, which they do not modify, but list as
+// in-place to get a fresh copy: equal images, so nothing stops early
+static void opEquals(Inputs* in, int param) { ImageEquals(in->src, in->work); }
+static void opPSNR(Inputs* in, int param) { ImagePSNR(in->src, in->work); }
+
+static void opDiff(Inputs* in, int param) {
+  Image d = ImageDiff(in->src, in->work);
+  check(d != NULL, "Differencing");
+  ImageDestroy(&d);
+}
+
+static void opPaste(Inputs* in, int param) {
+  ImagePaste(in->work, ImageWidth(in->work) / 3, ImageHeight(in->work) / 3, in->patch);
+}
+
+static void opBlend(Inputs* in, int param) {
+  ImageBlend(in->work, ImageWidth(in->work) / 3, ImageHeight(in->work) / 3, in->patch,
+             param / 100.0);
+}
+
+// Three overlapping layers, the middle one masked
+static void opComposite(Inputs* in, int param) {
+  int w = ImageWidth(in->work), h = ImageHeight(in->work);
+  ImageLayer layers[3] = {
+    { in->patch, NULL, w / 8, h / 8, 0.5 },
+    { in->patch, in->mask, w / 4, h / 4, 1.0 },
+    { in->patch, NULL, w / 2, h / 2, 0.25 },
+  };
+  ImageComposite(in->work, layers, 3);
+}
+
+static void opMatch(Inputs* in, int param) {
+  Image t = in->tmpl[param];
+  int x = ImageWidth(in->src) - ImageWidth(t);
+  int y = ImageHeight(in->src) - ImageHeight(t);
+  (void)ImageMatchSubImage(in->src, x, y, t);
+}
+
+static void opLocate(Inputs* in, int param) {
+  int x, y;
+  (void)ImageLocateSubImage(in->src, &x, &y, in->tmpl[param]);
+}
+
+static void opBlur(Inputs* in, int param) { check(ImageBlur(in->work, param, param), "Blurring"); }
+static void opMedian(Inputs* in, int param) { check(ImageMedian(in->work, param, param), "Filtering"); }
+static void opErode(Inputs* in, int param) { check(ImageErode(in->work, param, param), "Eroding"); }
+static void opDilate(Inputs* in, int param) { check(ImageDilate(in->work, param, param), "Dilating"); }
+static void opOpen(Inputs* in, int param) { check(ImageOpen(in->work, param, param), "Opening"); }
+static void opClose(Inputs* in, int param) { check(ImageClose(in->work, param, param), "Closing"); }
+
+// Box filter of size param x param
+static void opConvolve(Inputs* in, int param) {
+  int kernel[9 * 9];
+  for (int i = 0; i < param * param; i++) kernel[i] = 1;
+  check(ImageConvolve(in->work, kernel, param, param, param * param, 0), "Convolving");
+}
+
+static void opSobel(Inputs* in, int param) { check(ImageSobel(in->work), "Sobel"); }
+
+static void opLabel(Inputs* in, int param) {
+  ImageComponent* comps;
+  check(ImageLabelComponents(in->bin, param, NULL, &comps) >= 0, "Labeling");
+  free(comps);
+}
+
+static void opBitmap(Inputs* in, int param) {
+  Bitmap b = BitmapFromImage(in->src, (uint8)param);
+  check(b != NULL, "Converting");
+  (void)BitmapCount(b);
+  BitmapDestroy(&b);
+}
+
+static void opRLE(Inputs* in, int param) {
+  RLEImage r = RLEFromImage(in->src);
+  check(r != NULL, "Encoding");
+  RLEDestroy(&r);
+}
+
+// Round trip to the tiled layout and back
+static void opTile(Inputs* in, int param) {
+  check(ImageSetLayout(in->work, IMAGE_TILED), "Tiling");
+  check(ImageSetLayout(in->work, IMAGE_RASTER), "Untiling");
+}
+
+static const Op ops[] = {
+  { "stats", "", 0, 0, opStats },
+  { "histogram", "", 0, 0, opHistogram },
+  { "neg", "", 0, 1, opNegative },
+  { "thr", "128", 128, 1, opThreshold },
+  { "bri", "1.3", 130, 1, opBrighten },
+  { "autocontrast", "0.01", 1, 1, opAutoContrast },
+  { "equalize", "", 0, 1, opEqualize },
+  { "neg@", "", 0, 1, opNegativeRect },
+  { "rotate", "", 0, 0, opOrient },
+  { "rotate180", "", 1, 0, opOrient },
+  { "rotate270", "", 2, 0, opOrient },
+  { "transpose", "", 3, 0, opOrient },
+  { "mirror", "", 4, 0, opOrient },
+  { "flip", "", 5, 0, opOrient },
+  { "crop", "", 0, 0, opCrop },
+  { "resize", "nearest/50", 500 + IMAGE_RESIZE_NEAREST, 0, opResize },
+  { "resize", "bilinear/50", 500 + IMAGE_RESIZE_BILINEAR, 0, opResize },
+  { "resize", "bilinear/200", 2000 + IMAGE_RESIZE_BILINEAR, 0, opResize },
+  { "resize", "area/50", 500 + IMAGE_RESIZE_AREA, 0, opResize },
+  { "resize", "area/10", 100 + IMAGE_RESIZE_AREA, 0, opResize },
+  { "equals", "", 0, 1, opEquals },
+  { "psnr", "", 0, 1, opPSNR },
+  { "diff", "", 0, 1, opDiff },
+  { "paste", "", 0, 1, opPaste },
+  { "pastemany", "8", 0, 1, opPasteMany },
+  { "pastemany", "32", 1, 1, opPasteMany },
+  { "blend", "0.33", 33, 1, opBlend },
+  { "composite", "3", 0, 1, opComposite },
+  { "match", "8", 0, 0, opMatch },
+  { "match", "32", 1, 0, opMatch },
+  { "locate", "8", 0, 0, opLocate },
+  { "locate", "32", 1, 0, opLocate },
+  { "blur", "1", 1, 1, opBlur },
+  { "blur", "3", 3, 1, opBlur },
+  { "blur", "7", 7, 1, opBlur },
+  { "blur", "25", 25, 1, opBlur },
+  { "blur@", "3", 3, 1, opBlurRect },
+  { "median", "1", 1, 1, opMedian },
+  { "median", "3", 3, 1, opMedian },
+  { "erode", "3", 3, 1, opErode },
+  { "dilate", "3", 3, 1, opDilate },
+  { "open", "3", 3, 1, opOpen },
+  { "close", "3", 3, 1, opClose },
+  { "conv", "3", 3, 1, opConvolve },
+  { "conv", "5", 5, 1, opConvolve },
+  { "sobel", "", 0, 1, opSobel },
+  { "label", "4", 4, 0, opLabel },
+  { "label", "8", 8, 0, opLabel },
+  { "bitmap", "128", 128, 0, opBitmap },
+  { "rle", "", 0, 0, opRLE },
+  { "tile", "", 0, 1, opTile },
+};
+#define NOPS (int)(sizeof(ops) / sizeof(ops[0]))
+
+// Synthetic image of the named pattern
+static Image synthetic(int w, int h, int pattern) {
+  Image img = ImageCreate(w, h, PixMax);
+  check(img != NULL, "Creating image");
+  uint32_t seed = 12345u;
+  double scale = (double)PixMax / (w + h > 2 ? w + h - 2 : 1);
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      uint8 v;
+      switch (pattern) {
+      case 0: seed = seed * 1103515245u + 12345u; v = (uint8)(seed >> 24); break;
+      case 1: v = (uint8)((x + y) * scale); break;
+      default: v = PixMax / 2; break;
+      }
+      ImageSetPixel(img, x, y, v);
+    }
+  }
+  return img;
+}
+
+static Image copy(Image img) {
+  Image c = ImageCrop(img, 0, 0, ImageWidth(img), ImageHeight(img));
+  check(c != NULL, "Copying image");
+  return c;
+}
+
+static void makeInputs(Inputs* in, int w, int h, int pattern) {
+  in->src = synthetic(w, h, pattern);
+  in->work = copy(in->src);
+  int pw = (w + 3) / 4, ph = (h + 3) / 4;
+  in->patch = synthetic(pw, ph, (pattern + 1) % NPATTERNS);
+  in->mask = synthetic(pw, ph, 1);
+  in->bin = copy(in->src);
+  ImageThreshold(in->bin, PixMax / 2);
+  for (int i = 0; i < NTEMPLATES; i++) {
+    int tw = templateSizes[i] < w ? templateSizes[i] : w;
+    int th = templateSizes[i] < h ? templateSizes[i] : h;
+    in->tmpl[i] = ImageCrop(in->src, w - tw, h - th, tw, th);
+    check(in->tmpl[i] != NULL, "Cropping template");
+  }
+}
+
+static void freeInputs(Inputs* in) {
+  ImageDestroy(&in->src);
+  ImageDestroy(&in->work);
+  ImageDestroy(&in->patch);
+  ImageDestroy(&in->mask);
+  ImageDestroy(&in->bin);
+  for (int i = 0; i < NTEMPLATES; i++) ImageDestroy(&in->tmpl[i]);
+}
+
+// Restore in->work to a copy of in->src
+static void resetWork(Inputs* in) {
+  ImagePaste(in->work, 0, 0, in->src);
+}
+
+static double wallTime(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + 1.0e-9 * (double)t.tv_nsec;
+}
+
+static int cmpDouble(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Result of one measurement (times in seconds, counters per run)
+typedef struct {
+  int reps;
+  double median, min, cpu;
+  double counts[NUMCOUNTERS];
+} Result;
+
+#define MAXREPS 1000
+
+static Result measure(const Op* op, Inputs* in, int minReps, double minTime, int warmup) {
+  static double wall[MAXREPS], cpu[MAXREPS];
+  Result r = { 0 };
+  if (op->inPlace) resetWork(in);
+  for (int i = 0; i < warmup; i++) op->run(in, op->param);
+  double total = 0.0;
+  while (r.reps < MAXREPS && (r.reps < minReps || total < minTime)) {
+    InstrReset();
+    double c0 = cpu_time();
+    double t0 = wallTime();
+    op->run(in, op->param);
+    wall[r.reps] = wallTime() - t0;
+    cpu[r.reps] = cpu_time() - c0;
+    for (int i = 0; i < NUMCOUNTERS; i++) r.counts[i] += InstrCount[i];
+    total += wall[r.reps];
+    r.reps++;
+  }
+  for (int i = 0; i < NUMCOUNTERS; i++) r.counts[i] /= r.reps;
+  qsort(wall, r.reps, sizeof(double), cmpDouble);
+  qsort(cpu, r.reps, sizeof(double), cmpDouble);
+  r.median = wall[r.reps / 2];
+  r.min = wall[0];
+  r.cpu = cpu[r.reps / 2];
+  return r;
+}
+
+// Is name in the comma-separated list? (NULL list: use dflt)
+static int selected(const char* list, const char* name, int dflt) {
+  if (list == NULL) return dflt;
+  size_t n = strlen(name);
+  for (const char* p = list; *p != '\0'; ) {
+    size_t len = strcspn(p, ",");
+    if (len == n && strncmp(p, name, n) == 0) return 1;
+    p += len;
+    if (*p == ',') p++;
+  }
+  return 0;
+}
+
+// Baseline: the measurements of an earlier run, read from its CSV output.
+typedef struct {
+  char* key;                      // "op,arg,size,pattern"
+  double median;                  // in ns
+  double counts[NUMCOUNTERS];     // per run, for counters named now
+  int hasCount[NUMCOUNTERS];
+  int seen;                       // measured in this run?
+} BaseEntry;
+
+static BaseEntry* base = NULL;    // NULL: print CSV, do not compare
+static int nbase = 0;
+static double tolerance = 10.0;   // in percent
+static int compared = 0;
+static int regressions = 0;
+
+// Split line (in place) at commas into at most max fields; returns the count.
+static int splitCSV(char* line, char* fields[], int max) {
+  int n = 0;
+  line[strcspn(line, "\r\n")] = '\0';
+  for (char* p = line; n < max; ) {
+    fields[n++] = p;
+    p = strchr(p, ',');
+    if (p == NULL) break;
+    *p++ = '\0';
+  }
+  return n;
+}
+
+static int column(char* names[], int n, const char* name) {
+  for (int i = 0; i < n; i++) {
+    if (strcmp(names[i], name) == 0) return i;
+  }
+  return -1;
+}
+
+#define MAXFIELDS 64
+
+static void loadBaseline(const char* filename) {
+  FILE* f = fopen(filename, "r");
+  if (f == NULL) error(2, errno, "Opening baseline %s", filename);
+  char head[1024], line[1024];
+  char* names[MAXFIELDS];
+  char* fields[MAXFIELDS];
+  if (fgets(head, sizeof(head), f) == NULL) error(2, 0, "Empty baseline %s", filename);
+  int ncols = splitCSV(head, names, MAXFIELDS);
+  int cOp = column(names, ncols, "op");
+  int cArg = column(names, ncols, "arg");
+  int cSize = column(names, ncols, "size");
+  int cPattern = column(names, ncols, "pattern");
+  int cMedian = column(names, ncols, "median_ns");
+  int cSIMD = column(names, ncols, "simd");
+  int cThreads = column(names, ncols, "threads");
+  if (cOp < 0 || cArg < 0 || cSize < 0 || cPattern < 0 || cMedian < 0) {
+    error(2, 0, "Baseline %s: not an imageBench CSV file", filename);
+  }
+  int cCount[NUMCOUNTERS];
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    cCount[i] = InstrName[i] != NULL ? column(names, ncols, InstrName[i]) : -1;
+  }
+  int size = 0;
+  int warned = 0;
+  for (int lineno = 2; fgets(line, sizeof(line), f) != NULL; lineno++) {
+    int n = splitCSV(line, fields, MAXFIELDS);
+    if (n != ncols) error(2, 0, "Baseline %s:%d: expected %d fields", filename, lineno, ncols);
+    if (nbase == size) {
+      size = size == 0 ? 64 : 2 * size;
+      base = realloc(base, size * sizeof(BaseEntry));
+      if (base == NULL) error(2, errno, "Reading baseline");
+    }
+    BaseEntry* e = &base[nbase++];
+    size_t len = strlen(fields[cOp]) + strlen(fields[cArg]) + strlen(fields[cSize]) +
+                 strlen(fields[cPattern]) + 4;
+    e->key = malloc(len);
+    if (e->key == NULL) error(2, errno, "Reading baseline");
+    snprintf(e->key, len, "%s,%s,%s,%s", fields[cOp], fields[cArg], fields[cSize], fields[cPattern]);
+    e->median = atof(fields[cMedian]);
+    for (int i = 0; i < NUMCOUNTERS; i++) {
+      e->hasCount[i] = cCount[i] >= 0;
+      e->counts[i] = cCount[i] >= 0 ? atof(fields[cCount[i]]) : 0.0;
+    }
+    e->seen = 0;
+    // Times are only comparable with the same kernels and threads
+    if (!warned && cSIMD >= 0 && cThreads >= 0 &&
+        (strcmp(fields[cSIMD], ImageSIMDName(ImageGetSIMD())) != 0 ||
+         atoi(fields[cThreads]) != ImageThreads())) {
+      printf("# WARNING: baseline ran with %s, %s threads; now %s, %d threads\n",
+             fields[cSIMD], fields[cThreads], ImageSIMDName(ImageGetSIMD()), ImageThreads());
+      warned = 1;
+    }
+  }
+  fclose(f);
+  printf("%-13s %-5s %-6s %-9s %-8s %14s %14s %9s\n",
+         "# op", "arg", "size", "pattern", "what", "baseline", "now", "change");
+}
+
+static BaseEntry* findBase(const char* key) {
+  for (int i = 0; i < nbase; i++) {
+    if (strcmp(base[i].key, key) == 0) return &base[i];
+  }
+  return NULL;
+}
+
+// Print one line of the comparison table; returns 1 on a regression.
+static int diffLine(const Op* op, const char* size, const char* pattern, const char* what,
+                    double then, double now) {
+  double change = then > 0.0 ? 100.0 * (now - then) / then : (now > 0.0 ? 100.0 : 0.0);
+  int worse = change > tolerance;
+  printf("%-13s %-5s %-6s %-9s %-8s %14.0f %14.0f %+8.1f%%%s\n",
+         op->name, op->arg, size, pattern, what, then, now, change,
+         worse ? "  REGRESSION" : (change < -tolerance ? "  improved" : ""));
+  return worse;
+}
+
+// Compare a measurement with its baseline
+static void compare(const Op* op, const char* size, const char* pattern, const Result* r) {
+  char key[256];
+  snprintf(key, sizeof(key), "%s,%s,%s,%s", op->name, op->arg, size, pattern);
+  BaseEntry* e = findBase(key);
+  if (e == NULL) {
+    printf("%-13s %-5s %-6s %-9s (not in baseline)\n", op->name, op->arg, size, pattern);
+    return;
+  }
+  e->seen = 1;
+  compared++;
+  int worse = diffLine(op, size, pattern, "ns", e->median, r->median * 1e9);
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    if (InstrName[i] != NULL && e->hasCount[i]) {
+      worse |= diffLine(op, size, pattern, InstrName[i], e->counts[i], r->counts[i]);
+    }
+  }
+  regressions += worse;
+}
+
+static int summary(void) {
+  for (int i = 0; i < nbase; i++) {
+    if (!base[i].seen) printf("# not measured now: %s\n", base[i].key);
+  }
+  printf("# %d measurements compared, %d regressions (tolerance %g%%)\n",
+         compared, regressions, tolerance);
+  return regressions > 0;
+}
+
+static void header(void) {
+  printf("op,arg,size,width,height,pattern,simd,threads,reps,"
+         "median_ns,min_ns,cpu_ns,ns_per_pixel,gb_per_s");
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    if (InstrName[i] != NULL) printf(",%s", InstrName[i]);
+  }
+  printf("\n");
+}
+
+static void benchSize(const char* size, int w, int h, const char* patList, const char* opList,
+                      int minReps, double minTime, int warmup) {
+  for (int p = 0; p < NPATTERNS; p++) {
+    if (!selected(patList, patterns[p], 1)) continue;
+    fprintf(stderr, "# %s %dx%d %s\n", size, w, h, patterns[p]);
+    Inputs in;
+    makeInputs(&in, w, h, p);
+    for (int k = 0; k < NOPS; k++) {
+      const Op* op = &ops[k];
+      if (!selected(opList, op->name, 1)) continue;
+      Result r = measure(op, &in, minReps, minTime, warmup);
+      if (base != NULL) {
+        compare(op, size, patterns[p], &r);
+        fflush(stdout);
+        continue;
+      }
+      double pixels = (double)w * h;
+      printf("%s,%s,%s,%d,%d,%s,%s,%d,%d,%.0f,%.0f,%.0f,%.4f,%.3f",
+             op->name, op->arg, size, w, h, patterns[p],
+             ImageSIMDName(ImageGetSIMD()), ImageThreads(), r.reps,
+             r.median * 1e9, r.min * 1e9, r.cpu * 1e9, r.median * 1e9 / pixels,
+             r.median > 0.0 ? r.counts[0] / r.median * 1e-9 : 0.0);
+      for (int i = 0; i < NUMCOUNTERS; i++) {
+        if (InstrName[i] != NULL) printf(",%.0f", r.counts[i]);
+      }
+      printf("\n");
+      fflush(stdout);
+    }
+    freeInputs(&in);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  const char* sizeList = NULL;
+  const char* patList = NULL;
+  const char* opList = NULL;
+  int minReps = 5;
+  double minTime = 0.1;
+  int warmup = 1;
+  const char* baseline = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:p:o:r:t:w:c:T:")) != -1) {
+    switch (opt) {
+    case 's': sizeList = optarg; break;
+    case 'p': patList = optarg; break;
+    case 'o': opList = optarg; break;
+    case 'r': minReps = atoi(optarg); break;
+    case 't': minTime = atof(optarg); break;
+    case 'w': warmup = atoi(optarg); break;
+    case 'c': baseline = optarg; break;
+    case 'T': tolerance = atof(optarg); break;
+    default:
+      fprintf(stderr, "Usage: %s [-s SIZES] [-p PATTERNS] [-o OPS] [-r MINREPS] "
+              "[-t MINTIME] [-w WARMUP] [-c BASELINE [-T PCT]]\n", argv[0]);
+      exit(1);
+    }
+  }
+  if (minReps < 1 || minReps > MAXREPS || minTime < 0.0 || warmup < 0 || tolerance < 0.0) {
+    error(1, 0, "Invalid repetitions, time, warm-up or tolerance");
+  }
+
+  ImageInit();
+  if (baseline != NULL) {
+    loadBaseline(baseline);
+  } else {
+    header();
+  }
+  for (int s = 0; s < NSIZES; s++) {
+    if (selected(sizeList, sizes[s].name, sizes[s].byDefault)) {
+      benchSize(sizes[s].name, sizes[s].width, sizes[s].height, patList, opList,
+                minReps, minTime, warmup);
+    }
+  }
+  // Custom WxH sizes
+  for (const char* p = sizeList; p != NULL && *p != '\0'; ) {
+    int w, h, n;
+    if (sscanf(p, "%dx%d%n", &w, &h, &n) == 2 && w > 0 && h > 0 &&
+        (p[n] == ',' || p[n] == '\0')) {
+      char name[32];
+      snprintf(name, sizeof(name), "%dx%d", w, h);
+      benchSize(name, w, h, patList, opList, minReps, minTime, warmup);
+    }
+    p += strcspn(p, ",");
+    if (*p == ',') p++;
+  }
+  return base != NULL ? summary() : 0;
+}
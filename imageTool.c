@@ -9,18 +9,32 @@
 // João Manuel Rodrigues <jmr@ua.pt>
 // 2023
 
+#define _GNU_SOURCE  // fopencookie
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include "error.h"
 #include <assert.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "image8bit.h"
 #include "instrumentation.h"
 
 static const char* USAGE =
     "USAGE: imageTool [FILE...] [OPERATION [OPERAND...]]\n"
+    "       imageTool --serve SOCKET\n"
+    "       imageTool --stream [OPERATION [OPERAND...]]...\n"
     "  Apply pipeline of image processing operations to PGM files.\n"
     "  Arguments are processed from left to right and may be\n"
     "  FILES, OPERATIONS, or OPERANDS to operations.\n"
@@ -31,37 +45,104 @@ static const char* USAGE =
     "  Most operations apply to CURR and some also use PRED.\n"
     "\n"
     "FILES:\n"
-    "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
+    "  Image files in raw (P5) or plain (P2) PGM format are accepted.  Levels\n"
+    "  of 16-bit files (maxval above 255) are rescaled to [0, 255].\n"
     "  Input file names must be distinct from operation names.\n"
     "\n"
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
-    "  save FILE       Save CURR to PGM file\n"
-    "  info            Show information on CURR (size and range)\n"
+    "  save FILE       Save CURR to PGM file (in the background: saving\n"
+    "                  finishes before FILE is loaded or saved again, or at exit)\n"
+    "  save16 FILE     Save CURR to PGM file with 16-bit samples (maxval 65535)\n"
+    "  savepbm FILE    Save CURR as bit-packed PBM file (nonzero pixels white)\n"
+    "  info            Show information on CURR (size, range, histogram stats)\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
+    "  repeat N OP     Run operation OP (with its operands) N times, each on a\n"
+    "                  fresh copy of CURR, after one warm-up run; print min,\n"
+    "                  median, p90, p99 and max of wall and cpu time and the\n"
+    "                  counters per run.  CURR and the buffer are unchanged.\n"
+    "  layout MODE     Store CURR, and images loaded or created after, in\n"
+    "                  MODE layout: raster (default) or tiled (64x64 tiles)\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
+    "  autocontrast CLIP  Stretch CURR levels to full range, clipping\n"
+    "                  a fraction CLIP of pixels at each end (e.g. 0.01)\n"
+    "  equalize        Equalize the histogram of CURR\n"
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
+    "  rotate180       Rotate CURR 180º, creating new image\n"
+    "  rotate270       Rotate CURR 270º counter-clockwise, creating new image\n"
+    "  transpose       Transpose CURR (swap x and y), creating new image\n"
+    "  flip            Flip CURR top-to-bottom, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
+    "  resize W,H[,M]  Resize CURR to WxH, creating new image; M is the\n"
+    "                  resampling mode: nearest, bilinear or area (default:\n"
+    "                  area, best for thumbnails)\n"
     "\n"              
     "  paste X,Y       Paste PRED into CURR at position (X,Y)\n"
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
+    "  composite LAYERS Blend all LAYERS into CURR, in order, in one pass\n"
+    "  pastemany PLACES Paste images into CURR, in order, in one pass: PLACES\n"
+    "                  is I,X,Y/I,X,Y/... (image I at position (X,Y), I < CURR)\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  bitlocate       Same as locate, comparing only zero/nonzero, on bitmaps\n"
+    "  compare         Compare PRED with CURR: print EQUAL, or how they differ\n"
+    "                  (size, maxval, or first differing pixel, max abs diff\n"
+    "                  and PSNR), and fail if they differ\n"
+    "  diff            Absolute difference of PRED and CURR (same size),\n"
+    "                  creating new image; report as compare, without failing\n"
+    "  bitcount        Print number of nonzero pixels in CURR\n"
+    "  label 4|8       Print connected components of nonzero pixels of CURR\n"
+    "                  (area, bounding box, centroid), with given connectivity\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  median DX,DY    filter CURR using (2DX+1)x(2DY+1) median filter\n"
+    "  erode DX,DY     erode CURR with a (2DX+1)x(2DY+1) rectangle (local min)\n"
+    "  dilate DX,DY    dilate CURR with a (2DX+1)x(2DY+1) rectangle (local max)\n"
+    "  open DX,DY      open CURR (erode then dilate)\n"
+    "  close DX,DY     close CURR (dilate then erode)\n"
+    "  conv KERNEL     convolve CURR with integer KERNEL (borders replicated)\n"
+    "  sobel           replace CURR by its Sobel edge magnitude\n"
     "\n"              
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
     "  DX,DY           Displacement\n"
     "  W,H             Width and height of image or rectangular region\n"
     "  alpha           Blending factor\n"
+    "  @X,Y,W,H        Optional suffix of neg, thr, bri and blur (e.g. neg@0,0,10,10):\n"
+    "                  only the rectangle (X,Y,W,H) of CURR changes\n"
+    "  KERNEL          KW,KH,DIV,BIAS,k0,k1,...: KWxKH coefficients (row by row),\n"
+    "                  result = round(sum/DIV) + BIAS; e.g. sharpen:\n"
+    "                  3,3,1,0,0,-1,0,-1,5,-1,0,-1,0\n"
+    "  LAYERS          One or more I,X,Y,alpha[,M] separated by '/': blend\n"
+    "                  image In at (X,Y), optionally weighted by mask image Im\n"
+    "                  (I, M < CURR)\n"
+    "\n"
+    "SERVER MODE:\n"
+    "  With --serve, imageTool listens on the Unix domain socket SOCKET.\n"
+    "  Each line received is a pipeline with the grammar above, run on a\n"
+    "  fresh image buffer.  Query results are sent back, followed by a\n"
+    "  final line \"# OK\" or \"# ERROR: cause\".  Lines over 4095 bytes or\n"
+    "  512 words are rejected as a whole.\n"
+    "  Loaded files stay cached in memory (reloaded if modified on disk).\n"
+    "  Extra operations in server mode:\n"
+    "  keep NAME       Cache a copy of CURR under NAME, usable later as a FILE\n"
+    "  forget NAME     Drop NAME from the cache\n"
+    "  shutdown        Stop the server (must be the only operation)\n"
+    "\n"
+    "STREAM MODE:\n"
+    "  With --stream, imageTool reads a stream of PGM images (frames, one\n"
+    "  after the other) from stdin, runs the pipeline on each one, as I0 of\n"
+    "  a fresh buffer, and writes each resulting CURR to stdout, in order.\n"
+    "  Query results go to stderr.  Reading the next frame, processing one\n"
+    "  and writing the previous one overlap, on separate threads.\n"
+    "  Loaded files stay cached in memory, as in server mode.\n"
     "\n"
     ;
 
@@ -74,6 +155,9 @@ static char* errors[] = {
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "Not in server mode",
+  "Out of memory",
+  "Images differ",
 };
 
 
@@ -85,23 +169,336 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
-int main(int ac, char* av[]) {
-  program_name = av[0];
-  if (ac <= 1) {
-    error(5, 0, "\n%s", USAGE);
+// The image buffer capacity
+#define NIMG 10
+
+// Pipeline state: the image buffer and where query results go.
+typedef struct {
+  Image img[NIMG];  // the images
+  int n;            // number of images created
+  FILE* out;        // stream for query results (info, locate, toc, ...)
+  Image (*load)(const char* filename);  // how FILE operands are loaded
+  int server;       // nonzero when running requests for --serve
+  ImageLayout layout;  // pixel layout of loaded and created images
+  int once;         // run a single operation (for repeat)
+  int next;         // on return, index of the first operation not run
+} Pipeline;
+
+// Server mode image cache.
+// Entries are either files (reloaded when their mtime or size changes)
+// or images kept explicitly by name (mtime == 0).
+typedef struct cacheEntry {
+  char* name;
+  Image img;
+  time_t mtime;
+  off_t size;
+  struct cacheEntry* next;
+} CacheEntry;
+
+static CacheEntry* cache = NULL;
+
+static CacheEntry* cacheFind(const char* name) {
+  for (CacheEntry* e = cache; e != NULL; e = e->next) {
+    if (strcmp(e->name, name) == 0) return e;
   }
+  return NULL;
+}
 
-  ImageInit();
+// Store img under name, replacing any previous entry.
+// The cache takes ownership of img.
+static int cachePut(const char* name, Image img, time_t mtime, off_t size) {
+  CacheEntry* e = cacheFind(name);
+  if (e == NULL) {
+    e = malloc(sizeof(*e));
+    if (e == NULL) return 0;
+    e->name = strdup(name);
+    if (e->name == NULL) { free(e); return 0; }
+    e->next = cache;
+    cache = e;
+  } else {
+    ImageDestroy(&e->img);
+  }
+  e->img = img;
+  e->mtime = mtime;
+  e->size = size;
+  return 1;
+}
+
+static void cacheForget(const char* name) {
+  for (CacheEntry** pe = &cache; *pe != NULL; pe = &(*pe)->next) {
+    CacheEntry* e = *pe;
+    if (strcmp(e->name, name) == 0) {
+      *pe = e->next;
+      ImageDestroy(&e->img);
+      free(e->name);
+      free(e);
+      return;
+    }
+  }
+}
+
+static void cacheClear(void) {
+  while (cache != NULL) {
+    cacheForget(cache->name);
+  }
+}
+
+// Saves running in the background (see save), by file name.
+typedef struct pendingSave {
+  char* name;
+  ImageSaveJob job;
+  struct pendingSave* next;
+} PendingSave;
+
+static PendingSave* pending = NULL;
+
+// Start saving img to file name in the background.
+static int saveAsync(Image img, const char* name) {
+  ImageSaveJob job = ImageSaveAsync(img, name);
+  if (job == NULL) return 0;
+  PendingSave* e = malloc(sizeof(*e));
+  if (e == NULL || (e->name = strdup(name)) == NULL) {
+    free(e);
+    return ImageSaveWait(&job);  // no room to track it: just wait
+  }
+  e->job = job;
+  e->next = pending;
+  pending = e;
+  return 1;
+}
+
+// Wait for the background saves of file name (of all files, if NULL).
+// Returns 1 if they succeeded; otherwise returns 0, with errno/errCause
+// set by the last one that failed.
+static int waitSaves(const char* name) {
+  int ok = 1;
+  int errnum = errno;
+  for (PendingSave** pe = &pending; *pe != NULL; ) {
+    PendingSave* e = *pe;
+    if (name != NULL && strcmp(e->name, name) != 0) {
+      pe = &e->next;
+      continue;
+    }
+    if (!ImageSaveWait(&e->job)) {
+      ok = 0;
+      errnum = errno;
+      fprintf(stderr, "Saving %s failed\n", e->name);
+    }
+    *pe = e->next;
+    free(e->name);
+    free(e);
+  }
+  errno = errnum;
+  return ok;
+}
+
+// Copy of a whole image.
+static Image imageCopy(Image img) {
+  return ImageCrop(img, 0, 0, ImageWidth(img), ImageHeight(img));
+}
+
+// Loader used in server mode: returns a private copy of the cached image,
+// loading (or reloading) it from disk only when needed.
+static Image cacheLoad(const char* name) {
+  CacheEntry* e = cacheFind(name);
+  struct stat st;
+  int isFile = stat(name, &st) == 0;
+  if (e == NULL || (e->mtime != 0 && !isFile) ||
+      (e->mtime != 0 && (e->mtime != st.st_mtime || e->size != st.st_size))) {
+    Image img = ImageLoad(name);
+    if (img == NULL) return NULL;
+    if (!cachePut(name, img, st.st_mtime, st.st_size)) {
+      return img;  // could not cache it, but the load itself succeeded
+    }
+    e = cacheFind(name);
+  }
+  return imageCopy(e->img);
+}
+
+// Smallest level v such that at least fraction p of the pixels are <= v.
+static int histPercentile(const uint64_t hist[256], uint64_t total, double p) {
+  uint64_t cum = 0;
+  for (int v = 0; v < 256; v++) {
+    cum += hist[v];
+    if (cum > 0 && cum >= p * total) return v;
+  }
+  return 255;
+}
+
+// Compare images a and b, printing EQUAL, or how they differ: size,
+// maxval, or the first differing pixel, with the maximum absolute
+// difference and the PSNR of b with respect to a.
+// Returns 1 if they are equal (see ImageEquals).
+static int reportDiff(FILE* out, Image a, Image b) {
+  int x, y;
+  if (ImageWidth(a) != ImageWidth(b) || ImageHeight(a) != ImageHeight(b)) {
+    fprintf(out, "# DIFFERENT size: %dx%d vs %dx%d\n",
+            ImageWidth(a), ImageHeight(a), ImageWidth(b), ImageHeight(b));
+  } else if (ImageFindDiff(a, b, &x, &y)) {
+    fprintf(out, "# DIFFERENT at (%d,%d): %d vs %d\n",
+            x, y, ImageGetPixel(a, x, y), ImageGetPixel(b, x, y));
+    fprintf(out, "# Max abs diff: %d\n# PSNR: %.2f dB\n", ImageMaxAbsDiff(a, b), ImagePSNR(a, b));
+  } else if (ImageMaxval(a) != ImageMaxval(b)) {
+    fprintf(out, "# DIFFERENT maxval: %d vs %d\n", ImageMaxval(a), ImageMaxval(b));
+  } else {
+    fprintf(out, "# EQUAL\n");
+    return 1;
+  }
+  return 0;
+}
+
+// Print histogram-derived statistics (used by info).
+static void printHistStats(FILE* out, const uint64_t hist[256]) {
+  uint64_t total = 0;
+  double sum = 0.0, sum2 = 0.0;
+  for (int v = 0; v < 256; v++) {
+    total += hist[v];
+    sum += (double)v * hist[v];
+    sum2 += (double)v * v * hist[v];
+  }
+  if (total == 0) return;
+  double mean = sum / total;
+  double var = sum2 / total - mean * mean;
+  fprintf(out, "# Mean: %.3f\n# Stddev: %.3f\n", mean, var > 0.0 ? sqrt(var) : 0.0);
+  fprintf(out, "# Median: %d\n", histPercentile(hist, total, 0.5));
+  static const double pct[] = { 1, 5, 25, 75, 95, 99 };
+  fprintf(out, "# Percentiles:");
+  for (int i = 0; i < (int)(sizeof(pct)/sizeof(pct[0])); i++) {
+    fprintf(out, " p%g=%d", pct[i], histPercentile(hist, total, pct[i] / 100.0));
+  }
+  fprintf(out, "\n");
+}
+
+// Match operation word arg against name, which may have a region of
+// interest suffix "@X,Y,W,H" (stored in roi[0..3]).
+// Returns 0 if arg is not name, 1 if it is name without suffix, 2 if it
+// has a suffix, or -1 if the suffix is malformed.
+static int matchOp(const char* arg, const char* name, int roi[4]) {
+  size_t len = strlen(name);
+  if (strncmp(arg, name, len) != 0) return 0;
+  if (arg[len] == '\0') return 1;
+  if (arg[len] != '@') return 0;
+  char c;
+  if (sscanf(arg + len + 1, "%d,%d,%d,%d%c", &roi[0], &roi[1], &roi[2], &roi[3], &c) != 4) {
+    return -1;
+  }
+  return 2;
+}
+
+static int runPipeline(Pipeline* p, int ac, char* av[], int k);
+
+static double wallTime(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (double)t.tv_sec + 1.0e-9 * (double)t.tv_nsec;
+}
+
+static int cmpDouble(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile p of the n sorted values t.
+static double percentile(const double t[], int n, double p) {
+  int i = (int)ceil(p * n) - 1;
+  return t[i < 0 ? 0 : (i >= n ? n-1 : i)];
+}
+
+// Print the distribution of the n times t (sorting them), in ms.
+static void printTimes(FILE* out, const char* what, double t[], int n) {
+  qsort(t, n, sizeof(double), cmpDouble);
+  fprintf(out, "# %s (ms): min %.4f median %.4f p90 %.4f p99 %.4f max %.4f\n", what,
+          t[0] * 1e3, percentile(t, n, 0.5) * 1e3, percentile(t, n, 0.9) * 1e3,
+          percentile(t, n, 0.99) * 1e3, t[n-1] * 1e3);
+}
+
+// Run the operation at av[k] (with its operands) reps times, plus a
+// warm-up run, each time on a fresh copy of CURR in a scratch buffer.
+// Only the warm-up run prints its messages and results.
+// The instrumentation counters end up incremented by the timed runs.
+// Sets *last to the index of the operation's last operand.
+// Returns an index into errors[] (0 on success).
+static int repeatOp(Pipeline* p, int ac, char* av[], int k, int reps, int* last) {
+  int n = p->n;
+  double* wall = malloc(reps * sizeof(double));
+  double* cpu = malloc(reps * sizeof(double));
+  if (wall == NULL || cpu == NULL) { free(wall); free(cpu); return 9; }
+  FILE* null = fopen("/dev/null", "w");
+  int savedErr = -1;   // stderr, while silenced
+
+  unsigned long savedCount[NUMCOUNTERS];
+  memcpy(savedCount, InstrCount, sizeof(savedCount));
+  double savedTime = InstrTime;
+  double count[NUMCOUNTERS] = { 0.0 };
 
   int err = 0;
-  int x, y, w, h;
+  for (int r = -1; r < reps && err == 0; r++) {   // r == -1: warm-up
+    Pipeline s = *p;
+    s.once = 1;
+    if (r == 0 && null != NULL) {   // silence the timed runs
+      s.out = null;
+      fflush(stderr);
+      savedErr = dup(STDERR_FILENO);
+      if (savedErr >= 0) dup2(fileno(null), STDERR_FILENO);
+    } else if (r > 0 && null != NULL) {
+      s.out = null;
+    }
+    s.img[n-1] = imageCopy(p->img[n-1]);
+    if (s.img[n-1] == NULL) { err = 4; break; }
+    InstrReset();
+    double c0 = cpu_time();
+    double t0 = wallTime();
+    err = runPipeline(&s, ac, av, k);
+    if (r >= 0) {
+      wall[r] = wallTime() - t0;
+      cpu[r] = cpu_time() - c0;
+      for (int i = 0; i < NUMCOUNTERS; i++) count[i] += InstrCount[i];
+    }
+    *last = s.next - 1;
+    while (s.n >= n) {   // the copy and any images created from it
+      ImageDestroy(&s.img[--s.n]);
+    }
+  }
+  if (savedErr >= 0) {
+    fflush(stderr);
+    dup2(savedErr, STDERR_FILENO);
+    close(savedErr);
+  }
+  if (null != NULL) fclose(null);
+  for (int i = 0; i < NUMCOUNTERS; i++) {
+    InstrCount[i] = savedCount[i] + (unsigned long)count[i];
+  }
+  InstrTime = savedTime;
 
-  // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];     // the images
-  int n = 0;          // number of images created
+  if (err == 0) {
+    FILE* out = p->out;
+    fprintf(out, "# Repeat %s: %d runs\n", av[k], reps);
+    printTimes(out, "Wall", wall, reps);
+    printTimes(out, "CPU", cpu, reps);
+    for (int i = 0; i < NUMCOUNTERS; i++) {
+      if (InstrName[i] != NULL) {
+        fprintf(out, "# %s per run: %.1f\n", InstrName[i], count[i] / reps);
+      }
+    }
+  }
+  free(wall);
+  free(cpu);
+  return err;
+}
+
+// Run operations av[k..ac-1] on the pipeline image buffer
+// (only the operation at av[k], if p->once is set).
+// Returns an index into errors[] (0 on success).
+static int runPipeline(Pipeline* p, int ac, char* av[], int k) {
+  int err = 0;
+  int x, y, w, h;
+  int roi[4];   // region of interest of the current operation
+  int m;        // result of matchOp
+  Image* img = p->img;
+  const int N = NIMG;   // buffer capacity
+  int n = p->n;         // number of images created
+  FILE* out = p->out;
 
-  int k = 1;
   while (k < ac) {
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }
@@ -111,37 +508,93 @@ int main(int ac, char* av[]) {
       h = ImageHeight(img[n-1]);
       uint8 maxval = ImageMaxval(img[n-1]);
       ImageStats(img[n-1], &min, &max);
-      printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
-      printf("# Gray level range: [%hhu, %hhu]\n", min, max);
+      fprintf(out, "# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
+      fprintf(out, "# Gray level range: [%hhu, %hhu]\n", min, max);
+      uint64_t hist[256];
+      ImageHistogram(img[n-1], hist);
+      printHistStats(out, hist);
     } else if (strcmp(av[k], "tic") == 0) {
       InstrReset();
     } else if (strcmp(av[k], "toc") == 0) {
-      InstrPrint();
-    } else if (strcmp(av[k], "neg") == 0) {
+      InstrFPrint(out);
+    } else if (strcmp(av[k], "repeat") == 0) {
+      if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
-    } else if (strcmp(av[k], "thr") == 0) {
+      int reps;
+      if (sscanf(av[k], "%d", &reps) != 1 || reps < 1) { err = 5; break; }
+      if (++k >= ac) { err = 1; break; }
+      fprintf(stderr, "Repeating %s %d times on copies of I%d\n", av[k], reps, n-1);
+      p->n = n;
+      err = repeatOp(p, ac, av, k, reps, &k);
+      if (err != 0) break;
+    } else if ((m = matchOp(av[k], "neg", roi)) != 0) {
+      if (m < 0) { err = 5; break; }
+      if (n < 1) { err = 2; break; }
+      if (m == 1) {
+        fprintf(stderr, "Negating I%d\n", n-1);
+        ImageNegative(img[n-1]);
+      } else {
+        if (!ImageValidRect(img[n-1], roi[0], roi[1], roi[2], roi[3])) { err = 5; break; }   // precondition check!
+        fprintf(stderr, "Negating I%d (%d,%d,%d,%d)\n", n-1, roi[0], roi[1], roi[2], roi[3]);
+        ImageNegativeRect(img[n-1], roi[0], roi[1], roi[2], roi[3]);
+      }
+    } else if ((m = matchOp(av[k], "thr", roi)) != 0) {
+      if (m < 0) { err = 5; break; }
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       uint8 thr;
       if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
-      fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
-    } else if (strcmp(av[k], "bri") == 0) {
+      if (m == 1) {
+        fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
+        ImageThreshold(img[n-1], (uint8)thr);
+      } else {
+        if (!ImageValidRect(img[n-1], roi[0], roi[1], roi[2], roi[3])) { err = 5; break; }   // precondition check!
+        fprintf(stderr, "Thresholding I%d (%d,%d,%d,%d) at %d\n", n-1, roi[0], roi[1], roi[2], roi[3], thr);
+        ImageThresholdRect(img[n-1], roi[0], roi[1], roi[2], roi[3], (uint8)thr);
+      }
+    } else if ((m = matchOp(av[k], "bri", roi)) != 0) {
+      if (m < 0) { err = 5; break; }
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       double factor;
       if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
-      fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
+      if (factor < 0.0) { err = 5; break; }   // precondition check!
+      if (m == 1) {
+        fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
+        ImageBrighten(img[n-1], factor);
+      } else {
+        if (!ImageValidRect(img[n-1], roi[0], roi[1], roi[2], roi[3])) { err = 5; break; }   // precondition check!
+        fprintf(stderr, "Brightening I%d (%d,%d,%d,%d) by %lf\n", n-1, roi[0], roi[1], roi[2], roi[3], factor);
+        ImageBrightenRect(img[n-1], roi[0], roi[1], roi[2], roi[3], factor);
+      }
+    } else if (strcmp(av[k], "autocontrast") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      double clip;
+      if (sscanf(av[k], "%lf", &clip) != 1) { err = 5; break; }
+      if (!(0.0 <= clip && clip < 0.5)) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Auto-contrast I%d clipping %g\n", n-1, clip);
+      ImageAutoContrast(img[n-1], clip);
+    } else if (strcmp(av[k], "equalize") == 0) {
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Equalizing I%d\n", n-1);
+      ImageEqualize(img[n-1]);
+    } else if (strcmp(av[k], "layout") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      ImageLayout layout;
+      if (strcmp(av[k], "raster") == 0) layout = IMAGE_RASTER;
+      else if (strcmp(av[k], "tiled") == 0) layout = IMAGE_TILED;
+      else { err = 5; break; }
+      fprintf(stderr, "Using %s layout\n", av[k]);
+      p->layout = layout;
+      if (n >= 1 && !ImageSetLayout(img[n-1], layout)) { err = 4; break; }
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n >= N) { err = 3; break; }
       if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
       if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
       fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
-      img[n] = ImageCreate(w, h, PixMax);
+      img[n] = ImageCreateLayout(w, h, PixMax, p->layout);
       if (img[n] == NULL) { err = 4; break; }
       n++;
     } else if (strcmp(av[k], "rotate") == 0) {
@@ -158,6 +611,19 @@ int main(int ac, char* av[]) {
       img[n] = ImageMirror(img[n-1]);
       if (img[n] == NULL) { err = 4; break; }
       n++;
+    } else if (strcmp(av[k], "rotate180") == 0 || strcmp(av[k], "rotate270") == 0 ||
+               strcmp(av[k], "transpose") == 0 || strcmp(av[k], "flip") == 0) {
+      const char* op = av[k];
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      fprintf(stderr, "Applying %s to I%d -> I%d\n", op, n-1, n);
+      Image (*orient)(Image) =
+        strcmp(op, "rotate180") == 0 ? ImageRotate180 :
+        strcmp(op, "rotate270") == 0 ? ImageRotate270 :
+        strcmp(op, "transpose") == 0 ? ImageTranspose : ImageFlip;
+      img[n] = orient(img[n-1]);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
     } else if (strcmp(av[k], "crop") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
@@ -168,6 +634,25 @@ int main(int ac, char* av[]) {
       img[n] = ImageCrop(img[n-1], x, y, w, h);
       if (img[n] == NULL) { err = 4; break; }
       n++;
+    } else if (strcmp(av[k], "resize") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      char mode[16] = "area";
+      int got = sscanf(av[k], "%d,%d,%15s", &w, &h, mode);
+      if (got != 2 && got != 3) { err = 5; break; }
+      ImageResizeMode m;
+      if (strcmp(mode, "nearest") == 0) m = IMAGE_RESIZE_NEAREST;
+      else if (strcmp(mode, "bilinear") == 0) m = IMAGE_RESIZE_BILINEAR;
+      else if (strcmp(mode, "area") == 0) m = IMAGE_RESIZE_AREA;
+      else { err = 5; break; }
+      if (w <= 0 || h <= 0 || ImageWidth(img[n-1]) == 0 || ImageHeight(img[n-1]) == 0) {
+        err = 5; break;   // precondition check!
+      }
+      fprintf(stderr, "Resizing I%d to (%d,%d) %s -> I%d\n", n-1, w, h, mode, n);
+      img[n] = ImageResize(img[n-1], w, h, m);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
     } else if (strcmp(av[k], "paste") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 2) { err = 2; break; }
@@ -187,42 +672,576 @@ int main(int ac, char* av[]) {
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
       fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
       ImageBlend(img[n-1], x, y, img[n-2], alpha);
+    } else if (strcmp(av[k], "composite") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int nl = 1;
+      for (const char* c = av[k]; *c != '\0'; c++) nl += (*c == '/');
+      ImageLayer* layers = malloc(nl * sizeof(ImageLayer));
+      if (layers == NULL) { err = 9; break; }
+      const char* spec = av[k];
+      for (int l = 0; l < nl && err == 0; l++) {
+        int i, m, len;
+        ImageLayer* L = &layers[l];
+        L->mask = NULL;
+        int got = sscanf(spec, "%d,%d,%d,%lf%n,%d%n", &i, &L->x, &L->y, &L->alpha, &len, &m, &len);
+        if (got < 4 || (spec[len] != '/' && spec[len] != '\0')) { err = 5; break; }
+        if (i < 0 || i >= n-1) { err = 5; break; }   // precondition check!
+        L->img = img[i];
+        if (got == 5) {
+          if (m < 0 || m >= n-1) { err = 5; break; }   // precondition check!
+          L->mask = img[m];
+          if (ImageWidth(L->mask) != ImageWidth(L->img) ||
+              ImageHeight(L->mask) != ImageHeight(L->img)) { err = 5; break; }
+        }
+        w = ImageWidth(L->img);
+        h = ImageHeight(L->img);
+        if (!ImageValidRect(img[n-1], L->x, L->y, w, h)) { err = 6; break; }
+        spec += len + (spec[len] == '/');
+      }
+      if (err == 0) {
+        fprintf(stderr, "Compositing %d layers into I%d\n", nl, n-1);
+        ImageComposite(img[n-1], layers, nl);
+      }
+      free(layers);
+      if (err != 0) break;
+    } else if (strcmp(av[k], "pastemany") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int np = 1;
+      for (const char* c = av[k]; *c != '\0'; c++) np += (*c == '/');
+      ImagePlacement* places = malloc(np * sizeof(ImagePlacement));
+      if (places == NULL) { err = 9; break; }
+      const char* spec = av[k];
+      for (int l = 0; l < np && err == 0; l++) {
+        int i, len;
+        ImagePlacement* P = &places[l];
+        if (sscanf(spec, "%d,%d,%d%n", &i, &P->x, &P->y, &len) != 3 ||
+            (spec[len] != '/' && spec[len] != '\0')) { err = 5; break; }
+        if (i < 0 || i >= n-1) { err = 5; break; }   // precondition check!
+        P->img = img[i];
+        if (!ImageValidRect(img[n-1], P->x, P->y, ImageWidth(P->img), ImageHeight(P->img))) {
+          err = 6; break;
+        }
+        spec += len + (spec[len] == '/');
+      }
+      if (err == 0) {
+        fprintf(stderr, "Pasting %d images into I%d\n", np, n-1);
+        ImagePasteMany(img[n-1], places, np);
+      }
+      free(places);
+      if (err != 0) break;
     } else if (strcmp(av[k], "locate") == 0) {
       if (n < 2) { err = 2; break; }
       fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
       if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
-        printf("# FOUND (%d,%d)\n", x, y);
+        fprintf(out, "# FOUND (%d,%d)\n", x, y);
       } else {
-        printf("# NOTFOUND\n");
+        fprintf(out, "# NOTFOUND\n");
       }
-    } else if (strcmp(av[k], "blur") == 0) {
+    } else if (strcmp(av[k], "compare") == 0) {
+      if (n < 2) { err = 2; break; }
+      fprintf(stderr, "Comparing I%d with I%d\n", n-2, n-1);
+      if (!reportDiff(out, img[n-2], img[n-1])) { err = 10; break; }
+    } else if (strcmp(av[k], "diff") == 0) {
+      if (n < 2) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      if (ImageWidth(img[n-2]) != ImageWidth(img[n-1]) ||
+          ImageHeight(img[n-2]) != ImageHeight(img[n-1])) {
+        err = 5; break;   // precondition check!
+      }
+      fprintf(stderr, "Differencing I%d and I%d -> I%d\n", n-2, n-1, n);
+      reportDiff(out, img[n-2], img[n-1]);
+      img[n] = ImageDiff(img[n-2], img[n-1]);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if ((m = matchOp(av[k], "blur", roi)) != 0) {
+      if (m < 0) { err = 5; break; }
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      if (m == 1) {
+        fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
+        if (!ImageBlur(img[n-1], dx, dy)) { err = 4; break; }
+      } else {
+        if (!ImageValidRect(img[n-1], roi[0], roi[1], roi[2], roi[3])) { err = 5; break; }   // precondition check!
+        fprintf(stderr, "Blur I%d (%d,%d,%d,%d) with %dx%d mean filter\n", n-1, roi[0], roi[1], roi[2], roi[3], 2*dx+1, 2*dy+1);
+        if (!ImageBlurRect(img[n-1], roi[0], roi[1], roi[2], roi[3], dx, dy)) { err = 4; break; }
+      }
+    } else if (strcmp(av[k], "median") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       int dx; int dy;
       if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
-      fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
-      ImageBlur(img[n-1], dx, dy);
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Median I%d with %dx%d filter\n", n-1, 2*dx+1, 2*dy+1);
+      if (ImageMedian(img[n-1], dx, dy) == 0) { err = 4; break; }
+    } else if (strcmp(av[k], "erode") == 0 || strcmp(av[k], "dilate") == 0 ||
+               strcmp(av[k], "open") == 0 || strcmp(av[k], "close") == 0) {
+      const char* op = av[k];
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dy < 0) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Morphological %s of I%d with %dx%d rectangle\n", op, n-1, 2*dx+1, 2*dy+1);
+      int ok = op[0] == 'e' ? ImageErode(img[n-1], dx, dy) :
+               op[0] == 'd' ? ImageDilate(img[n-1], dx, dy) :
+               op[0] == 'o' ? ImageOpen(img[n-1], dx, dy) :
+                              ImageClose(img[n-1], dx, dy);
+      if (!ok) { err = 4; break; }
+    } else if (strcmp(av[k], "conv") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int kw, kh, div, bias, len;
+      if (sscanf(av[k], "%d,%d,%d,%d%n", &kw, &kh, &div, &bias, &len) != 4) { err = 5; break; }
+      if (kw <= 0 || kw % 2 == 0 || kh <= 0 || kh % 2 == 0 || div <= 0) { err = 5; break; }   // precondition check!
+      if (kw > 255 || kh > 255) { err = 5; break; }
+      int kernel[kw * kh];
+      const char* c = av[k] + len;
+      long sumabs = 0;
+      for (int i = 0; i < kw * kh && err == 0; i++) {
+        if (sscanf(c, ",%d%n", &kernel[i], &len) != 1) { err = 5; break; }
+        sumabs += labs(kernel[i]);
+        c += len;
+      }
+      if (err != 0) break;
+      if (*c != '\0' || sumabs * PixMax > INT32_MAX) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Convolving I%d with %dx%d kernel\n", n-1, kw, kh);
+      if (ImageConvolve(img[n-1], kernel, kw, kh, div, bias) == 0) { err = 4; break; }
+    } else if (strcmp(av[k], "sobel") == 0) {
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Sobel edges of I%d\n", n-1);
+      if (ImageSobel(img[n-1]) == 0) { err = 4; break; }
+    } else if (strcmp(av[k], "bitlocate") == 0) {
+      if (n < 2) { err = 2; break; }
+      fprintf(stderr, "Locating I%d in I%d as bitmaps\n", n-2, n-1);
+      Bitmap b1 = BitmapFromImage(img[n-1], 1);
+      Bitmap b2 = BitmapFromImage(img[n-2], 1);
+      if (b1 == NULL || b2 == NULL) { BitmapDestroy(&b1); BitmapDestroy(&b2); err = 4; break; }
+      if (BitmapLocateSub(b1, &x, &y, b2)) {
+        fprintf(out, "# FOUND (%d,%d)\n", x, y);
+      } else {
+        fprintf(out, "# NOTFOUND\n");
+      }
+      BitmapDestroy(&b1);
+      BitmapDestroy(&b2);
+    } else if (strcmp(av[k], "bitcount") == 0) {
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Counting nonzero pixels of I%d\n", n-1);
+      Bitmap b = BitmapFromImage(img[n-1], 1);
+      if (b == NULL) { err = 4; break; }
+      fprintf(out, "# Nonzero pixels: %" PRIu64 "\n", BitmapCount(b));
+      BitmapDestroy(&b);
+    } else if (strcmp(av[k], "label") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int conn;
+      if (sscanf(av[k], "%d", &conn) != 1) { err = 5; break; }
+      if (conn != 4 && conn != 8) { err = 5; break; }   // precondition check!
+      fprintf(stderr, "Labelling %d-connected components of I%d\n", conn, n-1);
+      ImageComponent* comps;
+      long nc = ImageLabelComponents(img[n-1], conn, NULL, &comps);
+      if (nc < 0) { err = 4; break; }
+      fprintf(out, "# Components: %ld\n", nc);
+      for (long i = 0; i < nc; i++) {
+        const ImageComponent* c = &comps[i];
+        fprintf(out, "%ld: area %" PRIu64 " bbox %d,%d,%d,%d centroid %.2f,%.2f\n",
+                i+1, c->area, c->xmin, c->ymin, c->xmax - c->xmin + 1,
+                c->ymax - c->ymin + 1, c->cx, c->cy);
+      }
+      free(comps);
+    } else if (strcmp(av[k], "savepbm") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Saving %s <- I%d as PBM\n", av[k], n-1);
+      if (!waitSaves(av[k])) { err = 4; break; }
+      Bitmap b = BitmapFromImage(img[n-1], 1);
+      if (b == NULL) { err = 4; break; }
+      int ok = BitmapSave(b, av[k]);
+      BitmapDestroy(&b);
+      if (!ok) { err = 4; break; }
+      if (p->server) fprintf(out, "# SAVED %s\n", av[k]);
+    } else if (strcmp(av[k], "save16") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      fprintf(stderr, "Saving %s <- I%d with 16-bit samples\n", av[k], n-1);
+      if (!waitSaves(av[k])) { err = 4; break; }
+      if (!ImageSave16(img[n-1], av[k], 65535)) { err = 4; break; }
+      if (p->server) fprintf(out, "# SAVED %s\n", av[k]);
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
-      if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
+      if (!waitSaves(av[k])) { err = 4; break; }   // an earlier save of the same file
+      if (!saveAsync(img[n-1], av[k])) { err = 4; break; }
+      if (p->server) fprintf(out, "# SAVED %s\n", av[k]);
+    } else if (strcmp(av[k], "keep") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (!p->server) { err = 8; break; }
+      fprintf(stderr, "Keeping I%d as %s\n", n-1, av[k]);
+      Image copy = imageCopy(img[n-1]);
+      if (copy == NULL) { err = 4; break; }
+      if (!cachePut(av[k], copy, 0, 0)) { ImageDestroy(&copy); err = 4; break; }
+    } else if (strcmp(av[k], "forget") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (!p->server) { err = 8; break; }
+      fprintf(stderr, "Forgetting %s\n", av[k]);
+      cacheForget(av[k]);
     } else {  // image file
       if (n >= N) { err = 3; break; }
       fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
-      img[n] = ImageLoad(av[k]);
+      if (!waitSaves(av[k])) { err = 4; break; }   // being saved: load the result
+      img[n] = p->load(av[k]);
       if (img[n] == NULL) { err = 4; break; }
+      if (!ImageSetLayout(img[n], p->layout)) { ImageDestroy(&img[n]); err = 4; break; }
       n++;
     }
     k++;
+    if (p->once) break;
   }
-  
-  // Destroy remaining images
-  while (n > 0) {
-    ImageDestroy(&img[--n]);
+  p->n = n;
+  p->next = k;
+  return err;
+}
+
+// Destroy all images in the pipeline buffer.
+static void clearPipeline(Pipeline* p) {
+  while (p->n > 0) {
+    ImageDestroy(&p->img[--p->n]);
+  }
+}
+
+// Maximum length of a request line and number of tokens in server mode
+#define LINEMAX 4096
+#define TOKMAX 512
+
+// Serve requests on a Unix domain socket until a "shutdown" request.
+// Each request line is split into whitespace-separated operations and run
+// as a pipeline on a fresh buffer; the library stays initialized and
+// loaded images stay cached between requests.
+static int serve(const char* path) {
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    error(5, 0, "Socket path too long: %s", path);
   }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
 
-  error(err, errno, errors[err], ImageErrMsg());
+  int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sfd < 0) error(4, errno, "socket");
+  unlink(path);
+  if (bind(sfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) error(4, errno, "bind %s", path);
+  if (listen(sfd, 16) < 0) error(4, errno, "listen %s", path);
+  signal(SIGPIPE, SIG_IGN);  // a client going away must not kill the server
+  fprintf(stderr, "Serving on %s\n", path);
+
+  int running = 1;
+  while (running) {
+    int cfd = accept(sfd, NULL, NULL);
+    if (cfd < 0) {
+      if (errno == EINTR) continue;
+      error(4, errno, "accept");
+    }
+    FILE* in = fdopen(cfd, "r");
+    FILE* out = fdopen(dup(cfd), "w");
+    if (in == NULL || out == NULL) {
+      error(0, errno, "fdopen");
+      if (in != NULL) fclose(in); else close(cfd);
+      if (out != NULL) fclose(out);
+      continue;
+    }
+    char line[LINEMAX];
+    while (running && fgets(line, sizeof(line), in) != NULL) {
+      // A line that filled the buffer without its '\n' is too long: drain
+      // the rest of it rather than run its pieces as separate requests.
+      int tooLong = strchr(line, '\n') == NULL && !feof(in);
+      if (tooLong) {
+        int c;
+        while ((c = getc(in)) != EOF && c != '\n') {}
+      }
+      char* tok[TOKMAX];
+      int ntok = 0;
+      char* t = strtok(line, " \t\r\n");
+      for (; t != NULL && ntok < TOKMAX; t = strtok(NULL, " \t\r\n")) {
+        tok[ntok++] = t;
+      }
+      if (t != NULL) tooLong = 1;  // tokens left over
+      if (tooLong) {
+        fprintf(out, "# ERROR: request too long\n");
+        fflush(out);
+        continue;
+      }
+      if (ntok == 0) continue;
+      if (ntok == 1 && strcmp(tok[0], "shutdown") == 0) {
+        fprintf(out, "# OK\n");
+        running = 0;
+        break;
+      }
+      Pipeline p = { .n = 0, .out = out, .load = cacheLoad, .server = 1 };
+      errno = 0;
+      int err = runPipeline(&p, ntok, tok, 0);
+      if (!waitSaves(NULL) && err == 0) err = 4;  // saved before replying
+      clearPipeline(&p);
+      if (err == 0) {
+        fprintf(out, "# OK\n");
+      } else {
+        fprintf(out, "# ERROR: ");
+        fprintf(out, errors[err], ImageErrMsg());
+        if (errno != 0) fprintf(out, ": %s", strerror(errno));
+        fprintf(out, "\n");
+      }
+      fflush(out);
+    }
+    fclose(out);
+    fclose(in);
+  }
+
+  close(sfd);
+  unlink(path);
+  cacheClear();
   return 0;
 }
 
+// Stream mode
+//
+// A reader thread reads frames from stdin, the main thread runs the
+// pipeline on each, and a writer thread writes the results to stdout.
+// The stages are connected by bounded queues of QUEUECAP frames, so they
+// overlap, but a slow stage makes the others wait rather than letting
+// frames pile up in memory.
+
+#define QUEUECAP 4
+
+// A bounded FIFO queue of images, for one producer and one consumer.
+// A NULL item marks the end of the stream.
+typedef struct {
+  Image item[QUEUECAP];
+  int head;
+  int count;
+  int closed;       // the consumer quit: pushes are refused
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} Queue;
+
+static void queueInit(Queue* q) {
+  q->head = q->count = q->closed = 0;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->changed, NULL);
+}
+
+// Append img, waiting while q is full.
+// Returns 0 if q was closed (img is not added).
+static int queuePush(Queue* q, Image img) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == QUEUECAP && !q->closed) pthread_cond_wait(&q->changed, &q->lock);
+  int ok = !q->closed;
+  if (ok) {
+    q->item[(q->head + q->count) % QUEUECAP] = img;
+    q->count++;
+    pthread_cond_broadcast(&q->changed);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return ok;
+}
+
+// Remove and return the first item, waiting while q is empty.
+static Image queuePop(Queue* q) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0) pthread_cond_wait(&q->changed, &q->lock);
+  Image img = q->item[q->head];
+  q->head = (q->head + 1) % QUEUECAP;
+  q->count--;
+  pthread_cond_broadcast(&q->changed);
+  pthread_mutex_unlock(&q->lock);
+  return img;
+}
+
+// Called by a consumer that quits: destroy the queued images and refuse
+// further pushes (waking up a waiting producer).
+static void queueClose(Queue* q) {
+  pthread_mutex_lock(&q->lock);
+  while (q->count > 0) {
+    ImageDestroy(&q->item[q->head]);
+    q->head = (q->head + 1) % QUEUECAP;
+    q->count--;
+  }
+  q->closed = 1;
+  pthread_cond_broadcast(&q->changed);
+  pthread_mutex_unlock(&q->lock);
+}
+
+// One end of the stream: its queue, file and failure (if any)
+typedef struct {
+  Queue* q;
+  FILE* f;
+  int errnum;          // errno of the failure
+  const char* cause;   // NULL, or the ImageErrMsg of the failure
+} StreamEnd;
+
+// Input that a reader blocked on it can be stopped from: reads fd, but
+// fails with ECANCELED once the write end of the wake pipe is closed.
+typedef struct {
+  int fd;
+  int wake;     // read end of the wake pipe
+} StopIn;
+
+static ssize_t stopInRead(void* cookie, char* buf, size_t size) {
+  StopIn* s = cookie;
+  struct pollfd fds[2] = { { s->fd, POLLIN, 0 }, { s->wake, POLLIN, 0 } };
+  while (poll(fds, 2, -1) < 0) {
+    if (errno != EINTR) return -1;
+  }
+  if (fds[1].revents != 0) {
+    errno = ECANCELED;
+    return -1;
+  }
+  return read(s->fd, buf, size);
+}
+
+static void* streamReader(void* arg) {
+  StreamEnd* in = arg;
+  while (!ImageStreamEnd(in->f)) {
+    Image img = ImageRead(in->f);
+    if (img == NULL) {
+      in->errnum = errno;
+      in->cause = ImageErrMsg();
+      break;
+    }
+    if (!queuePush(in->q, img)) {  // the pipeline quit
+      ImageDestroy(&img);
+      return NULL;
+    }
+  }
+  if (in->cause == NULL && ferror(in->f)) {
+    in->errnum = errno;
+    in->cause = "Reading stream failed";
+  }
+  queuePush(in->q, NULL);
+  return NULL;
+}
+
+static void* streamWriter(void* arg) {
+  StreamEnd* out = arg;
+  Image img;
+  while ((img = queuePop(out->q)) != NULL) {
+    int ok = ImageWrite(img, out->f);
+    if (ok && fflush(out->f) != 0) ok = 0;  // the frame is complete: send it now
+    ImageDestroy(&img);
+    if (!ok) {
+      out->errnum = errno;
+      out->cause = ImageErrMsg();
+      queueClose(out->q);
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+// Run the pipeline av[k..ac-1] on every frame from stdin, writing the
+// results to stdout.  Returns an index into errors[] (0 on success);
+// failures to read or write frames are reported here, and exit.
+static int streamFrames(int ac, char* av[], int k) {
+  // The reader reads stdin through a StopIn, so an early stop can wake it
+  // even while it is blocked in the middle of a frame.
+  int wake[2];
+  if (pipe(wake) < 0) error(4, errno, "Creating pipe");
+  StopIn stopIn = { STDIN_FILENO, wake[0] };
+  FILE* fin = fopencookie(&stopIn, "r", (cookie_io_functions_t){ .read = stopInRead });
+  if (fin == NULL) error(4, errno, "Opening stdin");
+
+  Queue inq, outq;
+  queueInit(&inq);
+  queueInit(&outq);
+  StreamEnd in = { &inq, fin, 0, NULL };
+  StreamEnd out = { &outq, stdout, 0, NULL };
+  pthread_t reader, writer;
+  int rc;
+  if ((rc = pthread_create(&reader, NULL, streamReader, &in)) != 0 ||
+      (rc = pthread_create(&writer, NULL, streamWriter, &out)) != 0) {
+    error(4, rc, "Creating threads");
+  }
+
+  int err = 0;
+  long frames = 0;
+  int stopped = 0;
+  Image img;
+  while (!stopped && (img = queuePop(&inq)) != NULL) {
+    Pipeline p = { .n = 1, .out = stderr, .load = cacheLoad, .server = 0 };
+    p.img[0] = img;
+    errno = 0;
+    err = runPipeline(&p, ac, av, k);
+    Image result = NULL;
+    if (err == 0) {  // take CURR out of the buffer
+      result = p.img[p.n - 1];
+      p.img[--p.n] = NULL;
+    }
+    clearPipeline(&p);
+    if (err != 0) {
+      fprintf(stderr, "Frame %ld failed\n", frames);
+      stopped = 1;
+    } else if (!queuePush(&outq, result)) {  // the writer quit
+      ImageDestroy(&result);
+      stopped = 1;
+    } else {
+      frames++;
+    }
+  }
+  int errnum = errno;  // of the failure, if any: cleanup must not clobber it
+  if (stopped) {
+    // Stop the reader: wake it if it waits for room in the queue or for
+    // input (its read then fails, and that failure is not reported).
+    queueClose(&inq);
+    close(wake[1]);
+    wake[1] = -1;
+  }
+  pthread_join(reader, NULL);
+  fclose(fin);
+  close(wake[0]);
+  if (wake[1] >= 0) close(wake[1]);
+  queuePush(&outq, NULL);
+  pthread_join(writer, NULL);
+  cacheClear();
+  errno = errnum;
+  if (!waitSaves(NULL) && err == 0) err = 4;
+
+  if (out.cause != NULL) error(4, out.errnum, errors[4], out.cause);
+  if (err == 0 && in.cause != NULL) {
+    error(4, in.errnum, "Frame %ld: %s", frames, in.cause);
+  }
+  if (err == 0) fprintf(stderr, "Streamed %ld frames\n", frames);
+  return err;
+}
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  if (ac <= 1) {
+    error(5, 0, "\n%s", USAGE);
+  }
+
+  ImageInit();
+
+  if (strcmp(av[1], "--serve") == 0) {
+    if (ac != 3) error(5, 0, "\n%s", USAGE);
+    return serve(av[2]);
+  }
+  if (strcmp(av[1], "--stream") == 0) {
+    int err = streamFrames(ac, av, 2);
+    error(err, errno, errors[err], ImageErrMsg());
+    return 0;
+  }
+
+  Pipeline p = { .n = 0, .out = stdout, .load = ImageLoad, .server = 0 };
+  int err = runPipeline(&p, ac, av, 1);
+  if (!waitSaves(NULL) && err == 0) err = 4;
+
+  // Destroy remaining images
+  clearPipeline(&p);
+
+  error(err, errno, errors[err], ImageErrMsg());
+  return 0;
+}
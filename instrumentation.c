@@ -68,8 +68,8 @@ double cpu_time(void) {
 
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (one per thread, so threads never race):
+_Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
 char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
@@ -110,20 +110,24 @@ void InstrReset(void) { ///
 
 // Print times and all named counter values
 void InstrPrint(void) { ///
+  InstrFPrint(stdout);
+}
+
+// Print times and all named counter values to stream f
+void InstrFPrint(FILE* f) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
   // compute time in calibrated time units:
   double caltime = time / InstrCTU;
 
-  printf("#%14.15s\t%15.15s", "time", "caltime");
+  fprintf(f, "#%14.15s\t%15.15s", "time", "caltime");
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15.15s", InstrName[i]);
-  puts("");
-  printf("%15.6f\t%15.6f", time, caltime);
+      fprintf(f, "\t%15.15s", InstrName[i]);
+  fputs("\n", f);
+  fprintf(f, "%15.6f\t%15.6f", time, caltime);
   for (int i = 0; i < NUMCOUNTERS; i++)
     if (InstrName[i] != NULL)
-      printf("\t%15lu", InstrCount[i]);  
-  puts("");
+      fprintf(f, "\t%15lu", InstrCount[i]);  
+  fputs("\n", f);
 }
-
@@ -22,14 +22,16 @@
 #ifndef INSTRUMENTATION_H
 #define INSTRUMENTATION_H
 
+#include <stdio.h>
+
 /// Cpu time in seconds
 double cpu_time(void) ; ///
 
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
-/// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (one per thread, so threads never race):
+extern _Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
@@ -48,7 +50,11 @@ void InstrCalibrate(void) ;
 /// Reset counters to zero and store cpu_time.
 void InstrReset(void) ;
 
+/// Print times and all named counter values (to stdout).
 void InstrPrint(void) ;
 
+/// Same as InstrPrint, but to stream f.
+void InstrFPrint(FILE* f) ;
+
 #endif
 
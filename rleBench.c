@@ -0,0 +1,109 @@
+// rleBench - Compare run-length encoded and raster images.
+//
+// Measures memory and time of the operations that RLEImage supports
+// directly on runs, against the same operations on the raw raster.
+//
+// Usage: rleBench [FILE.pgm...]
+// Without files, a synthetic 300dpi A4 "document" (white page with lines
+// of dark word blocks) is used.
+
+#include <errno.h>
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "image8bit.h"
+#include "instrumentation.h"
+
+// Build a synthetic scanned page: white background with text-like lines.
+static Image syntheticPage(void) {
+  const int w = 2480, h = 3508;
+  Image page = ImageCreate(w, h, PixMax);
+  if (page == NULL) return NULL;
+  ImageNegative(page);  // white
+  srand(42);
+  for (int y = 300; y + 40 < h - 300; y += 70) {
+    int x = 250;
+    while (x < w - 400) {
+      int ww = 40 + rand() % 200;
+      Image word = ImageCreate(ww, 36, PixMax);  // black block
+      if (word == NULL) { ImageDestroy(&page); return NULL; }
+      ImagePaste(page, x, y, word);
+      ImageDestroy(&word);
+      x += ww + 20 + rand() % 20;
+    }
+  }
+  return page;
+}
+
+// Run stmt repeatedly for at least 0.2s of cpu time; secs = time per run.
+#define TIMEIT(secs, stmt) do { \
+    int reps = 0; \
+    double t0 = cpu_time(), t; \
+    do { stmt; reps++; } while ((t = cpu_time() - t0) < 0.2); \
+    secs = t / reps; \
+  } while (0)
+
+static void report(const char* op, double traster, double trle) {
+  printf("%-10s %12.3f %12.3f %8.2fx\n", op, traster * 1e3, trle * 1e3, traster / trle);
+}
+
+static void bench(const char* name, Image img) {
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  RLEImage r = RLEFromImage(img);
+  if (r == NULL) error(2, errno, "Encoding %s: %s", name, ImageErrMsg());
+
+  printf("# %s: %dx%d, %zu runs (%.2f per row)\n", name, w, h, RLERuns(r), (double)RLERuns(r) / h);
+  printf("# memory: raster %zu bytes, RLE %zu bytes (%.1f%%)\n",
+         (size_t)w * h, RLEBytes(r), 100.0 * RLEBytes(r) / ((double)w * h));
+  printf("%-10s %12s %12s %9s\n", "# op", "raster(ms)", "rle(ms)", "speedup");
+
+  double ta, tb;
+  uint8 min, max;
+  TIMEIT(ta, ImageStats(img, &min, &max));
+  TIMEIT(tb, RLEStats(r, &min, &max));
+  report("stats", ta, tb);
+  TIMEIT(ta, ImageNegative(img));
+  TIMEIT(tb, RLENegative(r));
+  report("negative", ta, tb);
+  TIMEIT(ta, ImageThreshold(img, 128));
+  TIMEIT(tb, RLEThreshold(r, 128));
+  report("threshold", ta, tb);
+  TIMEIT(ta, { Image m = ImageMirror(img); ImageDestroy(&m); });
+  TIMEIT(tb, { RLEImage m = RLEMirror(r); RLEDestroy(&m); });
+  report("mirror", ta, tb);
+  TIMEIT(ta, { Image c = ImageCrop(img, w/4, h/4, w/2, h/2); ImageDestroy(&c); });
+  TIMEIT(tb, { RLEImage c = RLECrop(r, w/4, h/4, w/2, h/2); RLEDestroy(&c); });
+  report("crop", ta, tb);
+  Image ci = ImageCrop(img, w/4, h/4, w/2, h/2);
+  RLEImage cr = RLECrop(r, w/4, h/4, w/2, h/2);
+  if (ci == NULL || cr == NULL) error(2, errno, "Cropping %s: %s", name, ImageErrMsg());
+  TIMEIT(ta, ImagePaste(img, w/8, h/8, ci));
+  TIMEIT(tb, RLEPaste(r, w/8, h/8, cr));
+  report("paste", ta, tb);
+  TIMEIT(ta, { RLEImage e = RLEFromImage(img); RLEDestroy(&e); });
+  TIMEIT(tb, { Image d = RLEToImage(r); ImageDestroy(&d); });
+  printf("# conversion: encode %.3f ms, decode %.3f ms\n", ta * 1e3, tb * 1e3);
+
+  ImageDestroy(&ci);
+  RLEDestroy(&cr);
+  RLEDestroy(&r);
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  ImageInit();
+  if (argc == 1) {
+    Image page = syntheticPage();
+    if (page == NULL) error(2, errno, "Creating page: %s", ImageErrMsg());
+    bench("synthetic A4 page", page);
+    ImageDestroy(&page);
+  }
+  for (int i = 1; i < argc; i++) {
+    Image img = ImageLoad(argv[i]);
+    if (img == NULL) error(2, errno, "Loading %s: %s", argv[i], ImageErrMsg());
+    bench(argv[i], img);
+    ImageDestroy(&img);
+  }
+  return 0;
+}
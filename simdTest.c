@@ -0,0 +1,226 @@
+// simdTest - Check that every SIMD level gives identical results.
+//
+// Runs each dispatched operation on synthetic images of awkward sizes
+// (so vector loops also run their epilogues), with every SIMD level this
+// CPU supports, and compares the results with those of the scalar level.
+// Also checks 16-bit sample conversion at every level against exact rounding.
+//
+// Usage: simdTest
+// Exits with status 1 if any result differs.
+
+#include <errno.h>
+#include "error.h"
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include "image8bit.h"
+
+// Synthetic image: pattern 0 is pseudo-random, 1 a diagonal gradient,
+// 2 only extreme levels (0 and maxval), which exercise saturation.
+static Image synthetic(int w, int h, uint8 maxval, int pattern) {
+  Image img = ImageCreate(w, h, maxval);
+  if (img == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+  uint32_t seed = 12345u + (uint32_t)(w * 31 + h);
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      seed = seed * 1103515245u + 12345u;
+      int v;
+      switch (pattern) {
+      case 0: v = (seed >> 16) % (maxval + 1); break;
+      case 1: v = (x + 2 * y) % (maxval + 1); break;
+      default: v = (seed >> 20) & 1 ? maxval : 0; break;
+      }
+      ImageSetPixel(img, x, y, (uint8)v);
+    }
+  }
+  return img;
+}
+
+// Copy of img (also materializes lazy orientation views)
+static Image copy(Image img) {
+  Image c = ImageCrop(img, 0, 0, ImageWidth(img), ImageHeight(img));
+  if (c == NULL) error(2, errno, "Copying image: %s", ImageErrMsg());
+  return c;
+}
+
+// The operations under test.  Each one returns a new image, computed from
+// img (and other, an image of the same size).
+#define NOPS 24
+static const char* opNames[NOPS] = {
+  "neg", "thr 128", "thr 1", "bri 0.33", "bri 1.7", "stats",
+  "blend 0.33", "blend 0.5", "blend -0.7", "blend 2.5", "composite mask",
+  "blur 1,1", "blur 3,0", "blur@ 2,2", "rotate", "transpose",
+  "resize area 1/3", "resize bilinear 2/3", "resize bilinear 5/2",
+  "diff", "diffstats", "erode 2,1", "dilate 1,3", "erode 9,0",
+};
+
+static Image runOp(int op, Image img, Image other) {
+  Image r = copy(img);
+  int w = ImageWidth(img);
+  int h = ImageHeight(img);
+  double alphas[] = { 0.33, 0.5, -0.7, 2.5 };
+  switch (op) {
+  case 0: ImageNegative(r); break;
+  case 1: ImageThreshold(r, 128); break;
+  case 2: ImageThreshold(r, 1); break;
+  case 3: ImageBrighten(r, 0.33); break;
+  case 4: ImageBrighten(r, 1.7); break;
+  case 5: {  // stats, stored in the first pixels
+    uint8 min, max;
+    ImageStats(r, &min, &max);
+    ImageDestroy(&r);
+    r = ImageCreate(2, 1, PixMax);
+    if (r == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+    ImageSetPixel(r, 0, 0, min);
+    ImageSetPixel(r, 1, 0, max);
+    break;
+  }
+  case 6: case 7: case 8: case 9:
+    ImageBlend(r, 0, 0, other, alphas[op - 6]);
+    break;
+  case 10: {
+    ImageLayer layer = { other, img, 0, 0, 0.8 };  // img itself as mask
+    ImageComposite(r, &layer, 1);
+    break;
+  }
+  case 11: if (!ImageBlur(r, 1, 1)) error(2, errno, "Blur: %s", ImageErrMsg()); break;
+  case 12: if (!ImageBlur(r, 3, 0)) error(2, errno, "Blur: %s", ImageErrMsg()); break;
+  case 13:
+    if (!ImageBlurRect(r, w / 4, h / 4, w / 2, h / 2, 2, 2)) {
+      error(2, errno, "Blur: %s", ImageErrMsg());
+    }
+    break;
+  case 14: case 15: {
+    Image v = op == 14 ? ImageRotate(r) : ImageTranspose(r);
+    if (v == NULL) error(2, errno, "Orienting image: %s", ImageErrMsg());
+    Image m = ImageMirror(v);
+    if (m == NULL) error(2, errno, "Orienting image: %s", ImageErrMsg());
+    ImageDestroy(&r);
+    r = copy(m);
+    ImageDestroy(&m);
+    ImageDestroy(&v);
+    break;
+  }
+  case 19: {
+    Image d = ImageDiff(r, other);
+    if (d == NULL) error(2, errno, "Diff: %s", ImageErrMsg());
+    ImageDestroy(&r);
+    r = d;
+    break;
+  }
+  case 20: {  // first difference, max abs diff and PSNR, stored in pixels
+    int x = -1, y = -1;
+    ImageSetPixel(r, w - 1, h - 1, (uint8)(ImageGetPixel(r, w - 1, h - 1) ^ 1));
+    int found = ImageFindDiff(r, img, &x, &y);
+    int maxabs = ImageMaxAbsDiff(r, other);
+    double psnr = ImagePSNR(r, other);
+    ImageDestroy(&r);
+    r = ImageCreate(5, 1, PixMax);
+    if (r == NULL) error(2, errno, "Creating image: %s", ImageErrMsg());
+    ImageSetPixel(r, 0, 0, (uint8)found);
+    ImageSetPixel(r, 1, 0, (uint8)(x + y * w));   // found at the last pixel
+    ImageSetPixel(r, 2, 0, (uint8)maxabs);
+    ImageSetPixel(r, 3, 0, (uint8)(isinf(psnr) ? 255 : psnr));
+    ImageSetPixel(r, 4, 0, (uint8)(isinf(psnr) ? 255 : 100 * (psnr - (int)psnr)));
+    break;
+  }
+  case 16: case 17: case 18: {
+    int num[] = { 1, 2, 5 }, den[] = { 3, 3, 2 };
+    int rw = w * num[op - 16] / den[op - 16] + 1;
+    int rh = h * num[op - 16] / den[op - 16] + 1;
+    Image s = ImageResize(r, rw, rh, op == 16 ? IMAGE_RESIZE_AREA : IMAGE_RESIZE_BILINEAR);
+    if (s == NULL) error(2, errno, "Resize: %s", ImageErrMsg());
+    ImageDestroy(&r);
+    r = s;
+    break;
+  }
+  case 21: ImageErode(r, 2, 1); break;
+  case 22: ImageDilate(r, 1, 3); break;
+  case 23: ImageErode(r, 9, 0); break;
+  }
+  return r;
+}
+
+// Check ImageNarrow16 at the current SIMD level against exact rounding,
+// for all 16-bit samples.  Returns the number of wrong results.
+static int checkNarrow16(void) {
+  static uint16 src[65536];
+  static uint8 dst[65536];
+  const int srcMaxvals[] = { 1, 256, 1000, 4095, 65535 };
+  const uint8 maxvals[] = { 255, 100, 1 };
+  int wrong = 0;
+  for (int v = 0; v < 65536; v++) src[v] = (uint16)v;
+  for (int s = 0; s < 5; s++) {
+    for (int m = 0; m < 3; m++) {
+      int smax = srcMaxvals[s], dmax = maxvals[m];
+      ImageNarrow16(dst, src, 65536, smax, (uint8)dmax);
+      for (int v = 0; v < 65536; v++) {
+        int c = v < smax ? v : smax;
+        wrong += dst[v] != (c * dmax + smax / 2) / smax;
+      }
+    }
+  }
+  return wrong;
+}
+
+static int sameImage(Image a, Image b) {
+  return ImageWidth(a) == ImageWidth(b) && ImageHeight(a) == ImageHeight(b) &&
+         ImageMatchSubImage(a, 0, 0, b);
+}
+
+int main(int argc, char* argv[]) {
+  program_name = argv[0];
+  ImageInit();
+  ImageSIMDLevel initial = ImageGetSIMD();
+  ImageSIMDLevel best = ImageBestSIMD();
+  printf("# Best level: %s; selected by ImageInit: %s\n",
+         ImageSIMDName(best), ImageSIMDName(initial));
+
+  const int sizes[][2] = { {1, 1}, {7, 3}, {63, 65}, {257, 129}, {640, 48}, {1001, 17} };
+  const int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+  const uint8 maxvals[] = { 255, 100 };
+  int checks[IMAGE_SIMD_AVX512 + 1] = { 0 };
+  int failures = 0;
+
+  for (int s = 0; s < nsizes; s++) {
+    for (int m = 0; m < 2; m++) {
+      for (int pattern = 0; pattern < 3; pattern++) {
+        int w = sizes[s][0], h = sizes[s][1];
+        Image img = synthetic(w, h, maxvals[m], pattern);
+        Image other = synthetic(w, h, maxvals[m], (pattern + 1) % 3);
+        for (int op = 0; op < NOPS; op++) {
+          ImageSetSIMD(IMAGE_SIMD_SCALAR);
+          Image ref = runOp(op, img, other);
+          for (int level = IMAGE_SIMD_SCALAR + 1; level <= (int)best; level++) {
+            ImageSetSIMD(level);
+            Image r = runOp(op, img, other);
+            checks[level]++;
+            if (!sameImage(ref, r)) {
+              failures++;
+              printf("MISMATCH: %s, %s on %dx%d maxval %d pattern %d\n",
+                     ImageSIMDName(level), opNames[op], w, h, maxvals[m], pattern);
+            }
+            ImageDestroy(&r);
+          }
+          ImageDestroy(&ref);
+        }
+        ImageDestroy(&other);
+        ImageDestroy(&img);
+      }
+    }
+  }
+  for (int level = IMAGE_SIMD_SCALAR; level <= (int)best; level++) {
+    ImageSetSIMD(level);
+    int wrong = checkNarrow16();
+    if (wrong != 0) {
+      failures++;
+      printf("MISMATCH: %s, narrow16: %d wrong levels\n", ImageSIMDName(level), wrong);
+    }
+  }
+  for (int level = IMAGE_SIMD_SCALAR + 1; level <= (int)best; level++) {
+    printf("%s: %d results compared with scalar\n", ImageSIMDName(level), checks[level]);
+  }
+  printf(failures == 0 ? "# All levels identical\n" : "# %d mismatches\n", failures);
+  ImageSetSIMD(initial);
+  return failures == 0 ? 0 : 1;
+}